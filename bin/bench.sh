@@ -0,0 +1,2 @@
+#!/bin/sh
+cd build && ./sample_pipeline_bench $* > sample_pipeline_bench.json && cat sample_pipeline_bench.json && cd ..
@@ -6,8 +6,13 @@ sudo apt-get update && sudo apt-get install -qy \
   cppcheck \
   libarmadillo-dev \
   libboost-all-dev \
+  libfftw3-dev \
   libuhd-dev \
   libvulkan-dev \
+  libzstd-dev \
+  mesa-vulkan-drivers \
+  python3-numpy \
+  python3-zstandard \
   unzip \
   valgrind \
   wget \
@@ -1,2 +1,2 @@
 #!/bin/sh
-cd build && make test && valgrind --leak-check=yes --error-exitcode=1 ./sample_pipeline_test && cd .. && cppcheck lib/*cpp
+cd build && make test && valgrind --leak-check=yes --error-exitcode=1 ./sample_pipeline_test && ./uhd_sample_recorder --synthetic --unpaced --novkfft --nfft 2048 --fft_threads 2 --duration 5 --file /tmp/synthetic.zst && cd .. && cppcheck lib/*cpp
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Runs vkFFT twice on a synthetic source, checking the second run loads the
+# kernels cached by the first, and that the GPU dB points match FFTW's.
+# Needs a Vulkan device (e.g. mesa's lavapipe).
+CACHE_DIR=$(mktemp -d)
+cd build && for run in cold warm ; do
+  ./uhd_sample_recorder --synthetic --unpaced --nfft 2048 --duration 1 --vkfft_cache_dir $CACHE_DIR --file /tmp/synthetic_vkfft.zst 2> /tmp/vkfft_$run.log || { cat /tmp/vkfft_$run.log ; exit 1 ; }
+done && grep "vkFFT" /tmp/vkfft_cold.log /tmp/vkfft_warm.log && grep -q "loaded vkFFT kernels" /tmp/vkfft_warm.log && ls $CACHE_DIR/vkfft_*.bin && for type in short float double ; do
+  for fft in vkfft novkfft ; do
+    FFT_ARGS=$([ $fft = novkfft ] && echo --novkfft)
+    ./uhd_sample_recorder --synthetic --unpaced --nfft 2048 --nfft_overlap 1024 --fftshift --type $type --nsamps 4096000 --vkfft_cache_dir $CACHE_DIR $FFT_ARGS --file /tmp/synthetic_$fft.dat --fft_file /tmp/synthetic_fft_$fft.dat 2> /tmp/vkfft_$fft.log || { cat /tmp/vkfft_$fft.log ; exit 1 ; }
+  done
+  python3 -c "
+import numpy as np
+gpu = np.fromfile('/tmp/synthetic_fft_vkfft.dat', dtype=np.float32)
+cpu = np.fromfile('/tmp/synthetic_fft_novkfft.dat', dtype=np.float32)
+assert len(gpu) == len(cpu) and len(cpu), (len(gpu), len(cpu))
+err = np.percentile(np.abs(gpu - cpu), 99.9)
+print('$type', len(cpu), 'points, 99.9th percentile error', err, 'dB')
+assert err < 0.1
+" || exit 1
+done && rm -rf $CACHE_DIR
@@ -0,0 +1,92 @@
+#include "buffer_arena.h"
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <linux/mempolicy.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+BufferArena::BufferArena() : numa_node_(-1) {}
+
+BufferArena::~BufferArena() { release(); }
+
+BufferArena::Chunk BufferArena::map_chunk(size_t size) {
+  size = (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+  static bool warned_hugepages = false, warned_lock = false;
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p == MAP_FAILED) {
+    if (!warned_hugepages) {
+      warned_hugepages = true;
+      std::cerr << "hugepages unavailable (" << strerror(errno)
+                << "), using transparent hugepages" << std::endl;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+    if (p == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    madvise(p, size, MADV_HUGEPAGE);
+  }
+  if (numa_node_ >= 0) {
+    // mbind() directly, rather than requiring libnuma.
+    unsigned long nodemask[4] = {0};
+    const unsigned long bits = sizeof(nodemask[0]) * 8;
+    if (size_t(numa_node_) < sizeof(nodemask) * 8) {
+      nodemask[numa_node_ / bits] = 1UL << (numa_node_ % bits);
+    }
+    if (syscall(SYS_mbind, p, size, MPOL_BIND, nodemask,
+                sizeof(nodemask) * 8, 0)) {
+      std::cerr << "cannot bind buffers to NUMA node " << numa_node_ << ": "
+                << strerror(errno) << std::endl;
+    }
+  }
+  // first touch, placing the pages, then lock them in.
+  memset(p, 0, size);
+  if (mlock(p, size) && !warned_lock) {
+    warned_lock = true;
+    std::cerr << "cannot lock buffers in memory (" << strerror(errno)
+              << "), raise the locked memory limit (ulimit -l)" << std::endl;
+  }
+  Chunk chunk = {(char *)p, size, 0};
+  return chunk;
+}
+
+char *BufferArena::alloc(size_t size, size_t chunk_size) {
+  size = (size + kBufferArenaAlign - 1) / kBufferArenaAlign * kBufferArenaAlign;
+  if (chunks_.empty() || chunks_.back().used + size > chunks_.back().size) {
+    chunks_.push_back(map_chunk(std::max(size, chunk_size)));
+  }
+  Chunk &chunk = chunks_.back();
+  char *p = chunk.p + chunk.used;
+  chunk.used += size;
+  return p;
+}
+
+void BufferArena::release() {
+  for (const Chunk &chunk : chunks_) {
+    munmap(chunk.p, chunk.size);
+  }
+  chunks_.clear();
+}
+
+size_t BufferArena::mapped() const {
+  size_t size = 0;
+  for (const Chunk &chunk : chunks_) {
+    size += chunk.size;
+  }
+  return size;
+}
+
+int interface_numa_node(const std::string &interface) {
+  std::ifstream numa_node_file("/sys/class/net/" + interface +
+                               "/device/numa_node");
+  int numa_node = -1;
+  if (!(numa_node_file >> numa_node)) {
+    return -1;
+  }
+  return numa_node;
+}
@@ -0,0 +1,42 @@
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#ifndef BUFFER_ARENA_H
+#define BUFFER_ARENA_H 1
+const size_t kHugePageSize = 2 << 20;
+const size_t kBufferArenaAlign = 4096;
+
+// Memory for buffers on the receive path, mapped in chunks from 2MB
+// hugepages where available (otherwise pages, advised to use transparent
+// hugepages), optionally bound to a NUMA node, locked into RAM, and touched
+// up front, so using it never page faults. Buffers are only freed together,
+// by release().
+class BufferArena {
+public:
+  BufferArena();
+  ~BufferArena();
+  // Applies to chunks mapped after the call. numa_node -1 is any node.
+  void set_numa_node(int numa_node) { numa_node_ = numa_node; }
+  int numa_node() const { return numa_node_; }
+  // Returns size bytes, page aligned (as direct I/O needs), mapping a new
+  // chunk of at least chunk_size bytes if the current one is full.
+  char *alloc(size_t size, size_t chunk_size = kHugePageSize);
+  void release();
+  // Bytes mapped.
+  size_t mapped() const;
+
+private:
+  struct Chunk {
+    char *p;
+    size_t size, used;
+  };
+  Chunk map_chunk(size_t size);
+
+  std::vector<Chunk> chunks_;
+  int numa_node_;
+};
+
+// NUMA node of a network interface (e.g. eth0), or -1 if unknown.
+int interface_numa_node(const std::string &interface);
+#endif
@@ -0,0 +1,172 @@
+#include "ddc.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <type_traits>
+
+#include "sigpack/sigpack.h"
+
+#include "specgram.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Dot product of n2 / 2 interleaved complex samples with interleaved real
+// taps (n2 a multiple of 16).
+inline std::complex<float> fir_dot(const float *x_p, const float *taps2_p,
+                                   size_t n2) {
+#if defined(__AVX__)
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  for (size_t i = 0; i < n2; i += 16) {
+#if defined(__FMA__)
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x_p + i),
+                           _mm256_loadu_ps(taps2_p + i), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x_p + i + 8),
+                           _mm256_loadu_ps(taps2_p + i + 8), acc1);
+#else
+    acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(x_p + i),
+                                             _mm256_loadu_ps(taps2_p + i)));
+    acc1 = _mm256_add_ps(acc1,
+                         _mm256_mul_ps(_mm256_loadu_ps(x_p + i + 8),
+                                       _mm256_loadu_ps(taps2_p + i + 8)));
+#endif
+  }
+  const __m256 acc = _mm256_add_ps(acc0, acc1);
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc),
+                          _mm256_extractf128_ps(acc, 1));
+  // real parts are in the even lanes, imaginary in the odd.
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  float out[4];
+  _mm_storeu_ps(out, sum);
+  return std::complex<float>(out[0], out[1]);
+#elif defined(__SSE2__)
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  for (size_t i = 0; i < n2; i += 8) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x_p + i),
+                                       _mm_loadu_ps(taps2_p + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x_p + i + 4),
+                                       _mm_loadu_ps(taps2_p + i + 4)));
+  }
+  __m128 sum = _mm_add_ps(acc0, acc1);
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  float out[4];
+  _mm_storeu_ps(out, sum);
+  return std::complex<float>(out[0], out[1]);
+#elif defined(__ARM_NEON)
+  float32x4_t acc0 = vdupq_n_f32(0);
+  float32x4_t acc1 = vdupq_n_f32(0);
+  for (size_t i = 0; i < n2; i += 8) {
+    acc0 = vmlaq_f32(acc0, vld1q_f32(x_p + i), vld1q_f32(taps2_p + i));
+    acc1 = vmlaq_f32(acc1, vld1q_f32(x_p + i + 4), vld1q_f32(taps2_p + i + 4));
+  }
+  const float32x4_t acc = vaddq_f32(acc0, acc1);
+  const float32x2_t sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+  return std::complex<float>(vget_lane_f32(sum, 0), vget_lane_f32(sum, 1));
+#else
+  float re = 0, im = 0;
+  for (size_t i = 0; i < n2; i += 2) {
+    re += x_p[i] * taps2_p[i];
+    im += x_p[i + 1] * taps2_p[i + 1];
+  }
+  return std::complex<float>(re, im);
+#endif
+}
+
+DDC::DDC()
+    : decimation_(1), out_rate_(0), taps_(0), phase_(0), phase_inc_(0),
+      next_(0) {}
+
+void DDC::reset(size_t rate, double freq, double bw) {
+  if (bw <= 0 || std::fabs(freq) + bw / 2 > rate / 2.0) {
+    throw std::runtime_error("DDC sub-band must be within the sample rate");
+  }
+  decimation_ = std::max(size_t(rate / (kDDCOversample * bw)), size_t(1));
+  while (rate % decimation_) {
+    --decimation_;
+  }
+  out_rate_ = rate / decimation_;
+  arma::vec h = sp::fir1(kDDCTapsPerDecimation * decimation_,
+                         std::min(bw / rate, 1.0));
+  h /= arma::sum(h);
+  // padded (with zero taps for the oldest samples) for fir_dot().
+  taps_ = (h.n_elem + 7) / 8 * 8;
+  taps2_.assign(taps_ * 2, 0);
+  for (size_t i = 0; i < h.n_elem; ++i) {
+    taps2_[(taps_ - 1 - i) * 2] = h[i];
+    taps2_[(taps_ - 1 - i) * 2 + 1] = h[i];
+  }
+  ones2_.assign(kDDCBlock * 2, 1);
+  phase_ = 0;
+  phase_inc_ = -2 * M_PI * freq / rate;
+  block_nco_.resize(kDDCBlock);
+  for (size_t i = 0; i < kDDCBlock; ++i) {
+    block_nco_[i] = std::complex<float>(std::polar(1.0, phase_inc_ * i));
+  }
+  buf_.assign(taps_ - 1, std::complex<float>(0, 0));
+  buf_.reserve(taps_ - 1 + kDDCBlock);
+  next_ = taps_ - 1;
+}
+
+void DDC::filter() {
+  const float *buf_p = (const float *)buf_.data();
+  for (; next_ < buf_.size(); next_ += decimation_) {
+    out_.push_back(fir_dot(buf_p + (next_ + 1 - taps_) * 2, taps2_.data(),
+                           taps_ * 2));
+  }
+  // keep taps_ - 1 samples of history.
+  const size_t drop = buf_.size() - (taps_ - 1);
+  std::copy(buf_.begin() + drop, buf_.end(), buf_.begin());
+  buf_.resize(taps_ - 1);
+  next_ -= drop;
+}
+
+template <typename samp_type>
+const char *DDC::process(const samp_type *in_p, size_t n, size_t *bytes) {
+  out_.clear();
+  for (size_t i = 0; i < n; i += kDDCBlock) {
+    const size_t m = std::min(kDDCBlock, n - i);
+    const size_t start = buf_.size();
+    buf_.resize(start + m);
+    window_samples(in_p + i, buf_.data() + start, ones2_.data(), m, 1);
+    // mix with the block's phasors, rotated to the current phase (kept in
+    // double precision, so the NCO doesn't drift).
+    const std::complex<float> phasor(std::polar(1.0, phase_));
+    const float pr = phasor.real(), pi = phasor.imag();
+    const float *nco_p = (const float *)block_nco_.data();
+    float *x_p = (float *)(buf_.data() + start);
+    for (size_t k = 0; k < m * 2; k += 2) {
+      const float nr = nco_p[k] * pr - nco_p[k + 1] * pi;
+      const float ni = nco_p[k] * pi + nco_p[k + 1] * pr;
+      const float xr = x_p[k], xi = x_p[k + 1];
+      x_p[k] = xr * nr - xi * ni;
+      x_p[k + 1] = xr * ni + xi * nr;
+    }
+    phase_ = std::remainder(phase_ + phase_inc_ * m, 2 * M_PI);
+    filter();
+  }
+  if (std::is_same<samp_type, std::complex<short>>::value) {
+    out_sc16_.resize(out_.size());
+    const float *o_p = (const float *)out_.data();
+    short *s_p = (short *)out_sc16_.data();
+    for (size_t i = 0; i < out_.size() * 2; ++i) {
+      const float v = std::round(o_p[i]);
+      s_p[i] = short(std::min(std::max(v, -32768.0f), 32767.0f));
+    }
+    *bytes = out_sc16_.size() * sizeof(std::complex<short>);
+    return (const char *)out_sc16_.data();
+  }
+  *bytes = out_.size() * sizeof(std::complex<float>);
+  return (const char *)out_.data();
+}
+
+template const char *DDC::process(const std::complex<short> *in_p, size_t n,
+                                  size_t *bytes);
+template const char *DDC::process(const std::complex<float> *in_p, size_t n,
+                                  size_t *bytes);
+template const char *DDC::process(const std::complex<double> *in_p, size_t n,
+                                  size_t *bytes);
@@ -0,0 +1,55 @@
+#include <complex>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#ifndef DDC_H
+#define DDC_H 1
+// Samples are mixed and filtered this many at a time.
+const size_t kDDCBlock = 4096;
+// The decimated rate is at least this multiple of the bandwidth kept.
+const double kDDCOversample = 1.25;
+// FIR taps per unit of decimation.
+const size_t kDDCTapsPerDecimation = 16;
+
+// A sub-band to record: bw Hz around freq Hz from the center frequency,
+// written to file.
+struct DDCSpec {
+  double freq, bw;
+  std::string file;
+};
+
+// Digital downconverter. Mixes a sub-band down to DC with an NCO, low pass
+// filters it (sp::fir1 taps), and decimates by the largest factor of rate
+// that keeps at least kDDCOversample * bw, computing only the outputs kept
+// (the polyphase form of the filter). State is carried between calls.
+class DDC {
+public:
+  DDC();
+  void reset(size_t rate, double freq, double bw);
+  size_t decimation() const { return decimation_; }
+  size_t out_rate() const { return out_rate_; }
+  // Returns the downconverted samples (sc16 for short samples, otherwise
+  // fc32), valid until the next call.
+  template <typename samp_type>
+  const char *process(const samp_type *in_p, size_t n, size_t *bytes);
+
+private:
+  void filter();
+
+  size_t decimation_, out_rate_, taps_;
+  // taps reversed, each repeated for the real and imaginary parts.
+  std::vector<float> taps2_;
+  std::vector<float> ones2_;
+  // NCO phase (radians) of the next block, and the phasors of a block
+  // starting at phase 0.
+  double phase_, phase_inc_;
+  std::vector<std::complex<float>> block_nco_;
+  // taps_ - 1 samples of history, then the block being filtered; next_ is
+  // the index of the last sample of the next output.
+  std::vector<std::complex<float>> buf_;
+  size_t next_;
+  std::vector<std::complex<float>> out_;
+  std::vector<std::complex<short>> out_sc16_;
+};
+#endif
@@ -0,0 +1,126 @@
+#include "fft_encoding.h"
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+std::string fft_file_header(const std::string &json) {
+  const uint32_t len = json.size();
+  std::string header(kFFTHeaderMagic, kFFTHeaderMagicSize);
+  for (size_t i = 0; i < sizeof(len); ++i) {
+    header.push_back(char((len >> (i * 8)) & 0xff));
+  }
+  return header + json;
+}
+
+// IEEE half, rounding to nearest even.
+inline uint16_t float_to_half(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  const uint16_t sign = (x >> 16) & 0x8000;
+  const int32_t f_exp = (x >> 23) & 0xff;
+  uint32_t mant = x & 0x7fffff;
+  if (f_exp == 0xff) {
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+  }
+  const int32_t exp = f_exp - 127 + 15;
+  if (exp >= 31) {
+    return sign | 0x7c00;
+  }
+  if (exp <= 0) {
+    if (exp < -10) {
+      return sign;
+    }
+    // subnormal.
+    mant |= 0x800000;
+    const uint32_t shift = 14 - exp;
+    uint16_t half = mant >> shift;
+    const uint32_t rem = mant & ((1 << shift) - 1);
+    const uint32_t halfway = 1 << (shift - 1);
+    if (rem > halfway || (rem == halfway && (half & 1))) {
+      ++half;
+    }
+    return sign | half;
+  }
+  uint16_t half = sign | (exp << 10) | (mant >> 13);
+  const uint32_t rem = mant & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) {
+    // may carry into the exponent, which is still correct.
+    ++half;
+  }
+  return half;
+}
+
+void encode_float16(const float *in_p, uint16_t *out_p, size_t n) {
+  size_t i = 0;
+#if defined(__F16C__) && defined(__AVX__)
+  for (; i + 8 <= n; i += 8) {
+    _mm_storeu_si128(
+        (__m128i *)(out_p + i),
+        _mm256_cvtps_ph(_mm256_loadu_ps(in_p + i), _MM_FROUND_TO_NEAREST_INT));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; i + 4 <= n; i += 4) {
+    vst1_u16(out_p + i,
+             vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(in_p + i))));
+  }
+#endif
+  for (; i < n; ++i) {
+    out_p[i] = float_to_half(in_p[i]);
+  }
+}
+
+void encode_uint8(const float *in_p, uint8_t *out_p, size_t n, float db_min,
+                  float db_max) {
+  const float scale = 255.0 / (db_max - db_min);
+  for (size_t i = 0; i < n; ++i) {
+    float v = (in_p[i] - db_min) * scale;
+    v = v < 0 ? 0 : v;
+    v = v > 255 ? 255 : v;
+    out_p[i] = uint8_t(v + 0.5f);
+  }
+}
+
+FFTEncoder::FFTEncoder() : encoding_(kFloat32), db_min_(0), db_max_(0) {}
+
+void FFTEncoder::reset(const std::string &encoding, float db_min,
+                       float db_max) {
+  if (encoding == "float32") {
+    encoding_ = kFloat32;
+  } else if (encoding == "float16") {
+    encoding_ = kFloat16;
+  } else if (encoding == "uint8") {
+    encoding_ = kUint8;
+    if (db_max <= db_min) {
+      throw std::runtime_error("FFT dB range max must be greater than min");
+    }
+  } else {
+    throw std::runtime_error("Unknown FFT encoding " + encoding);
+  }
+  db_min_ = db_min;
+  db_max_ = db_max;
+}
+
+const char *FFTEncoder::encode(const float *points_p, size_t n,
+                               size_t *bytes) {
+  switch (encoding_) {
+  case kFloat16:
+    out_.resize(n * sizeof(uint16_t));
+    encode_float16(points_p, (uint16_t *)out_.data(), n);
+    break;
+  case kUint8:
+    out_.resize(n);
+    encode_uint8(points_p, (uint8_t *)out_.data(), n, db_min_, db_max_);
+    break;
+  default:
+    *bytes = n * sizeof(float);
+    return (const char *)points_p;
+  }
+  *bytes = out_.size();
+  return out_.data();
+}
@@ -0,0 +1,29 @@
+#include <string>
+#include <vector>
+
+#ifndef FFT_ENCODING_H
+#define FFT_ENCODING_H 1
+// FFT files start with kFFTHeaderMagic, a little endian uint32 length, and
+// that many bytes of JSON describing the encoding, frame size and timing.
+const char kFFTHeaderMagic[] = "UHDSRFFT";
+const size_t kFFTHeaderMagicSize = sizeof(kFFTHeaderMagic) - 1;
+
+std::string fft_file_header(const std::string &json);
+
+// Encodes dB FFT points as float32, float16 (IEEE half), or uint8 quantized
+// over [db_min, db_max].
+class FFTEncoder {
+public:
+  FFTEncoder();
+  void reset(const std::string &encoding, float db_min, float db_max);
+  bool is_float32() const { return encoding_ == kFloat32; }
+  // Returns the encoded points, valid until the next call.
+  const char *encode(const float *points_p, size_t n, size_t *bytes);
+
+private:
+  enum Encoding { kFloat32, kFloat16, kUint8 };
+  Encoding encoding_;
+  float db_min_, db_max_;
+  std::vector<char> out_;
+};
+#endif
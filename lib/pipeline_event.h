@@ -0,0 +1,60 @@
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+#ifndef PIPELINE_EVENT_H
+#define PIPELINE_EVENT_H 1
+const size_t kPipelineEventSpins = 100;
+
+// Wakeup for a pipeline thread waiting on a queue. A waiter takes a sequence
+// number with prepare(), checks the queue, and if there was nothing to do
+// calls wait() with it; any notify() after prepare() ends the wait. Waiters
+// spin briefly (if there is another CPU to notify them) before sleeping on a
+// futex.
+class PipelineEvent {
+public:
+  PipelineEvent() : seq_(0), waiters_(0) {}
+
+  uint32_t prepare() const { return seq_.load(); }
+
+  void notify() {
+    seq_.fetch_add(1);
+    if (waiters_.load()) {
+      syscall(SYS_futex, &seq_, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+  }
+
+  void wait(uint32_t seq) {
+    static const size_t spins =
+        std::thread::hardware_concurrency() > 1 ? kPipelineEventSpins : 0;
+    for (size_t i = 0; i < spins; ++i) {
+      if (seq_.load(std::memory_order_relaxed) != seq) {
+        return;
+      }
+      cpu_relax();
+    }
+    waiters_.fetch_add(1);
+    while (seq_.load() == seq) {
+      syscall(SYS_futex, &seq_, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+    }
+    waiters_.fetch_sub(1);
+  }
+
+private:
+  static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+  }
+
+  std::atomic<uint32_t> seq_;
+  std::atomic<uint32_t> waiters_;
+};
+#endif
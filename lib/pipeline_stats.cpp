@@ -0,0 +1,240 @@
+#include "pipeline_stats.h"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+const double kLatencyQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+inline size_t latency_bucket(uint64_t ns) {
+  if (ns < kLatencySubBuckets) {
+    return ns;
+  }
+  const size_t msb = 63 - __builtin_clzll(ns);
+  return (msb - 1) * kLatencySubBuckets +
+         ((ns >> (msb - 2)) & (kLatencySubBuckets - 1));
+}
+
+inline uint64_t latency_bucket_max(size_t bucket) {
+  if (bucket < kLatencySubBuckets) {
+    return bucket;
+  }
+  const size_t msb = bucket / kLatencySubBuckets + 1;
+  const uint64_t width = uint64_t(1) << (msb - 2);
+  return (kLatencySubBuckets + bucket % kLatencySubBuckets) * width + width -
+         1;
+}
+
+LatencyHistogram::LatencyHistogram() { reset(); }
+
+void LatencyHistogram::reset() {
+  for (auto &bucket : buckets_) {
+    bucket = 0;
+  }
+  count_ = 0;
+  sum_ = 0;
+  max_ = 0;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+  buckets_[latency_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(ns, std::memory_order_relaxed);
+  uint64_t max = max_.load(std::memory_order_relaxed);
+  while (ns > max && !max_.compare_exchange_weak(max, ns)) {
+  }
+}
+
+uint64_t LatencyHistogram::quantile_ns(double q) const {
+  const uint64_t target = q * count();
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kLatencyBuckets; ++i) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen > target) {
+      return std::min(latency_bucket_max(i), max_ns());
+    }
+  }
+  return max_ns();
+}
+
+void PipelineStats::reset() {
+  for (LatencyHistogram *histogram :
+       {&recv, &queue, &window, &fft, &fft_out, &write, &ddc}) {
+    histogram->reset();
+  }
+  sample_queue.reset();
+  in_fft_queue.reset();
+  out_fft_queue.reset();
+  samples.reset();
+  fft_points.reset();
+  ddc_samples.reset();
+}
+
+struct StageLatency {
+  const char *name;
+  const LatencyHistogram PipelineStats::*histogram;
+};
+
+const StageLatency kStages[] = {{"recv", &PipelineStats::recv},
+                                {"queue", &PipelineStats::queue},
+                                {"window", &PipelineStats::window},
+                                {"fft", &PipelineStats::fft},
+                                {"fft_out", &PipelineStats::fft_out},
+                                {"write", &PipelineStats::write},
+                                {"ddc", &PipelineStats::ddc}};
+
+struct QueueDepth {
+  const char *name;
+  const HighWaterMark PipelineStats::*depth;
+  const size_t PipelineStats::*capacity;
+};
+
+const QueueDepth kQueues[] = {
+    {"sample_queue", &PipelineStats::sample_queue,
+     &PipelineStats::sample_buffers},
+    {"in_fft_queue", &PipelineStats::in_fft_queue, &PipelineStats::fft_slots},
+    {"out_fft_queue", &PipelineStats::out_fft_queue,
+     &PipelineStats::fft_slots}};
+
+struct OutputBytes {
+  const char *name;
+  const WriterStats PipelineStats::*bytes;
+};
+
+const OutputBytes kOutputs[] = {{"samples", &PipelineStats::samples},
+                                {"fft", &PipelineStats::fft_points},
+                                {"ddc", &PipelineStats::ddc_samples}};
+
+double compression_ratio(const WriterStats &bytes) {
+  return bytes.bytes_out ? double(bytes.bytes_in) / bytes.bytes_out : 0;
+}
+
+nlohmann::json pipeline_stats_json(const PipelineStats &stats) {
+  nlohmann::json json;
+  for (const auto &stage : kStages) {
+    const LatencyHistogram &histogram = stats.*stage.histogram;
+    nlohmann::json latency;
+    latency["count"] = histogram.count();
+    latency["mean_us"] =
+        histogram.count() ? histogram.sum_ns() / 1e3 / histogram.count() : 0;
+    latency["p50_us"] = histogram.quantile_ns(0.5) / 1e3;
+    latency["p99_us"] = histogram.quantile_ns(0.99) / 1e3;
+    latency["max_us"] = histogram.max_ns() / 1e3;
+    json["latency"][stage.name] = latency;
+  }
+  for (const auto &queue : kQueues) {
+    const HighWaterMark &depth = stats.*queue.depth;
+    json["queues"][queue.name] = {{"depth", depth.value()},
+                                  {"high_water", depth.max()},
+                                  {"capacity", stats.*queue.capacity}};
+  }
+  for (const auto &output : kOutputs) {
+    const WriterStats &bytes = stats.*output.bytes;
+    json["bytes"][output.name] = {
+        {"in", bytes.bytes_in.load()},
+        {"out", bytes.bytes_out.load()},
+        {"compression_ratio", compression_ratio(bytes)}};
+  }
+  return json;
+}
+
+std::string pipeline_stats_prometheus(
+    const std::vector<std::pair<std::string, const PipelineStats *>>
+        &pipelines) {
+  const std::string prefix = "uhd_sample_recorder_";
+  std::ostringstream out;
+  out << "# HELP " << prefix
+      << "stage_latency_seconds Pipeline stage latency per buffer or FFT "
+         "slot.\n"
+      << "# TYPE " << prefix << "stage_latency_seconds summary\n";
+  for (const auto &pipeline : pipelines) {
+    for (const auto &stage : kStages) {
+      const LatencyHistogram &histogram = (*pipeline.second).*stage.histogram;
+      const std::string labels =
+          pipeline.first + ",stage=\"" + stage.name + "\"";
+      for (double q : kLatencyQuantiles) {
+        out << prefix << "stage_latency_seconds{" << labels << ",quantile=\""
+            << q << "\"} " << histogram.quantile_ns(q) / 1e9 << "\n";
+      }
+      out << prefix << "stage_latency_seconds_sum{" << labels << "} "
+          << histogram.sum_ns() / 1e9 << "\n"
+          << prefix << "stage_latency_seconds_count{" << labels << "} "
+          << histogram.count() << "\n";
+    }
+  }
+  out << "# HELP " << prefix
+      << "stage_latency_max_seconds Maximum pipeline stage latency.\n"
+      << "# TYPE " << prefix << "stage_latency_max_seconds gauge\n";
+  for (const auto &pipeline : pipelines) {
+    for (const auto &stage : kStages) {
+      out << prefix << "stage_latency_max_seconds{" << pipeline.first
+          << ",stage=\"" << stage.name << "\"} "
+          << ((*pipeline.second).*stage.histogram).max_ns() / 1e9 << "\n";
+    }
+  }
+  const std::pair<const char *, const char *> queue_metrics[] = {
+      {"queue_depth", "Buffers or FFT slots in a pipeline queue."},
+      {"queue_high_water", "Most buffers or FFT slots in a pipeline queue."},
+      {"queue_capacity", "Pipeline queue capacity."}};
+  for (size_t i = 0; i < 3; ++i) {
+    out << "# HELP " << prefix << queue_metrics[i].first << " "
+        << queue_metrics[i].second << "\n"
+        << "# TYPE " << prefix << queue_metrics[i].first << " gauge\n";
+    for (const auto &pipeline : pipelines) {
+      for (const auto &queue : kQueues) {
+        const PipelineStats &stats = *pipeline.second;
+        const HighWaterMark &depth = stats.*queue.depth;
+        const size_t value = i == 0   ? depth.value()
+                             : i == 1 ? depth.max()
+                                      : stats.*queue.capacity;
+        out << prefix << queue_metrics[i].first << "{" << pipeline.first
+            << ",queue=\"" << queue.name << "\"} " << value << "\n";
+      }
+    }
+  }
+  out << "# HELP " << prefix
+      << "bytes_in_total Bytes written to an output, before compression.\n"
+      << "# TYPE " << prefix << "bytes_in_total counter\n";
+  for (const auto &pipeline : pipelines) {
+    for (const auto &output : kOutputs) {
+      out << prefix << "bytes_in_total{" << pipeline.first << ",output=\""
+          << output.name << "\"} "
+          << ((*pipeline.second).*output.bytes).bytes_in << "\n";
+    }
+  }
+  out << "# HELP " << prefix
+      << "bytes_out_total Bytes written to an output's files.\n"
+      << "# TYPE " << prefix << "bytes_out_total counter\n";
+  for (const auto &pipeline : pipelines) {
+    for (const auto &output : kOutputs) {
+      out << prefix << "bytes_out_total{" << pipeline.first << ",output=\""
+          << output.name << "\"} "
+          << ((*pipeline.second).*output.bytes).bytes_out << "\n";
+    }
+  }
+  out << "# HELP " << prefix
+      << "compression_ratio Output bytes in per byte written to file.\n"
+      << "# TYPE " << prefix << "compression_ratio gauge\n";
+  for (const auto &pipeline : pipelines) {
+    for (const auto &output : kOutputs) {
+      out << prefix << "compression_ratio{" << pipeline.first << ",output=\""
+          << output.name << "\"} "
+          << compression_ratio((*pipeline.second).*output.bytes) << "\n";
+    }
+  }
+  return out.str();
+}
+
+void write_prometheus_file(const std::string &file, const std::string &text) {
+  const std::string tmp_file = file + ".tmp";
+  {
+    std::ofstream out(tmp_file);
+    out << text;
+    if (!out) {
+      throw std::runtime_error("cannot write " + tmp_file);
+    }
+  }
+  if (rename(tmp_file.c_str(), file.c_str())) {
+    throw std::runtime_error("cannot rename " + tmp_file + " to " + file);
+  }
+}
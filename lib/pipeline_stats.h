@@ -0,0 +1,89 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "json.hpp"
+#include "sample_writer.h"
+
+#ifndef PIPELINE_STATS_H
+#define PIPELINE_STATS_H 1
+// 4 buckets per power of 2 (so within 25%) up to 2^63 ns.
+const size_t kLatencySubBuckets = 4;
+const size_t kLatencyBuckets = 64 * kLatencySubBuckets;
+
+// Latency histogram (HDR style, log buckets with linear sub-buckets), safe
+// to record into from any thread and read while recording.
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+  void reset();
+  void record(uint64_t ns);
+  void record_since(std::chrono::steady_clock::time_point start) {
+    record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+               .count());
+  }
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t sum_ns() const { return sum_.load(std::memory_order_relaxed); }
+  uint64_t max_ns() const { return max_.load(std::memory_order_relaxed); }
+  // Upper bound of the bucket holding quantile q (0 to 1).
+  uint64_t quantile_ns(double q) const;
+
+private:
+  std::atomic<uint64_t> buckets_[kLatencyBuckets];
+  std::atomic<uint64_t> count_, sum_, max_;
+};
+
+class HighWaterMark {
+public:
+  HighWaterMark() : value_(0), max_(0) {}
+  void reset() {
+    value_ = 0;
+    max_ = 0;
+  }
+  void add() {
+    const size_t value = ++value_;
+    size_t max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value)) {
+    }
+  }
+  void remove() { --value_; }
+  size_t value() const { return value_.load(std::memory_order_relaxed); }
+  size_t max() const { return max_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<size_t> value_, max_;
+};
+
+// Telemetry for one sample pipeline, reset when it starts.
+struct PipelineStats {
+  PipelineStats() : sample_buffers(0), fft_slots(0) {}
+  void reset();
+  // recv: a sample buffer acquired until enqueued (filled).
+  // queue: enqueued until the writer thread takes it.
+  // window: FFT frames windowed (converted) from a buffer.
+  // fft: an FFT slot transformed.
+  // fft_out: an FFT slot converted to dB, encoded and written.
+  // write: a buffer of samples written (and compressed).
+  // ddc: a buffer of samples downconverted and written, for all sub-bands.
+  LatencyHistogram recv, queue, window, fft, fft_out, write, ddc;
+  // sample buffers enqueued, FFT slots queued for and done with transform.
+  HighWaterMark sample_queue, in_fft_queue, out_fft_queue;
+  size_t sample_buffers, fft_slots;
+  WriterStats samples, fft_points, ddc_samples;
+};
+
+nlohmann::json pipeline_stats_json(const PipelineStats &stats);
+// Prometheus text exposition format, for each pipeline's stats with its
+// labels (e.g. channel="0").
+std::string pipeline_stats_prometheus(
+    const std::vector<std::pair<std::string, const PipelineStats *>>
+        &pipelines);
+// Write to file, atomically (by rename), for the node_exporter textfile
+// collector.
+void write_prometheus_file(const std::string &file, const std::string &text);
+#endif
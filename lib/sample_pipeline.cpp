@@ -1,226 +1,1374 @@
 #include <boost/atomic.hpp>
+#include <boost/lockfree/queue.hpp>
 #include <boost/lockfree/spsc_queue.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/thread.hpp>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <deque>
+#include <mutex>
 
+#include "json.hpp"
 #include "sigpack/sigpack.h"
 
+#include "buffer_arena.h"
+#include "fft_encoding.h"
+#include "pipeline_event.h"
+#include "pipeline_stats.h"
 #include "sample_pipeline.h"
+#include "sample_ring.h"
 #include "sample_writer.h"
+#include "specgram.h"
 #include "vkfft.h"
 
 typedef void (*offload_p)(arma::cx_fmat &, arma::cx_fmat &);
 
-const size_t kSampleBuffers = 8;
+const size_t kDefaultSampleBuffers = 8;
+const size_t kMinSampleBuffers = 2;
 const size_t kFFTbuffers = 256;
+// FFT slots are limited to this many bytes (but at least kMinFFTSlots).
+const size_t kFFTSlotsBytes = 256 << 20;
+const size_t kMinFFTSlots = 4;
+// Snapshots are copied out of the history ring this many bytes at a time.
+const size_t kSnapshotChunk = 1 << 20;
 
-static arma::fvec hammingWindow;
-static float hammingWindowSum = 0;
-
-static size_t nfft = 0, nfft_overlap = 0, nfft_ds = 0, samp_size = 0,
-              max_samples = 0, max_buffer_size = 0;
-static bool useVkFFT = false;
-static offload_p offload;
-static void (*write_samples_p)(size_t &, size_t &);
-
-static std::pair<arma::cx_fmat, arma::cx_fmat> FFTBuffers[kFFTbuffers];
-static boost::lockfree::spsc_queue<size_t,
-                                   boost::lockfree::capacity<kFFTbuffers>>
-    in_fft_queue;
-static boost::lockfree::spsc_queue<size_t,
-                                   boost::lockfree::capacity<kFFTbuffers>>
-    out_fft_queue;
-static std::pair<char *, size_t> sampleBuffers[kSampleBuffers];
-static boost::lockfree::spsc_queue<size_t,
-                                   boost::lockfree::capacity<kSampleBuffers>>
-    sample_queue;
-static arma::cx_fvec fft_samples_in;
-static boost::atomic<bool> samples_input_done(false);
-static boost::atomic<bool> write_samples_worker_done(false);
-static boost::atomic<bool> fft_in_worker_done(false);
-static boost::scoped_ptr<SampleWriter> sample_writer;
-static boost::scoped_ptr<SampleWriter> fft_sample_writer;
-static boost::scoped_ptr<boost::thread_group> writer_threads;
-
-void enqueue_samples(size_t &buffer_ptr) {
-  if (!sample_queue.push(buffer_ptr)) {
-    std::cerr << "sample buffer queue failed (overflow)" << std::endl;
+typedef boost::lockfree::spsc_queue<size_t> sample_queue_t;
+
+// Configuration shared by all pipelines.
+static size_t samp_size = 0, zthreads = 0, prealloc_samples = 0,
+              buffer_mb = 0, fft_threads = 1, fft_avg_frames = 1,
+              fft_bin_decimation = 1;
+static bool direct_io = false, fftshift = false, fft_bin_max = false;
+static std::string samp_type_name;
+static int numa_node = -1;
+static double rotate_seconds = 0;
+static size_t rotate_bytes_option = 0;
+static bool trigger = false;
+static double trigger_dbfs = 0, trigger_pre_seconds = 0,
+              trigger_hang_seconds = 0;
+static double history_seconds = 0;
+static size_t seekable_frame_bytes = 0;
+static std::string fftw_wisdom_file, fftw_wisdom_loaded, vkfft_cache_dir;
+static std::string fft_avg_mode = "none";
+static std::string fft_encoding = "float32";
+static float fft_db_min = 0, fft_db_max = 0;
+// vkFFT is kept initialized between captures with the same parameters. It
+// has one set of GPU buffers, used by one pipeline at a time.
+static std::mutex vkfft_mutex;
+static bool vkfft_ready = false;
+static size_t vkfft_batches = 0, vkfft_nfft = 0, vkfft_sample_id = 0;
+
+// An FFT slot holds up to fft_slot_frames frames in (windowed, or with
+// gpu_raw_frames, unwindowed samples packed nfft * samp_size bytes apart),
+// and their complex FFT out, or with gpu_power_db, dB points computed by
+// vkFFT. Slots are preallocated from fft_arena.
+struct FFTSlot {
+  std::complex<float> *in_p, *out_p;
+  float *points_p;
+  size_t frames;
+};
+
+class SamplePipeline::Impl {
+public:
+  Impl();
+  size_t acquire_sample_buffer();
+  size_t discard_sample_buffer(size_t buffer_ptr);
+  void enqueue_samples(size_t buffer_ptr);
+  void release_sample_buffer(size_t buffer_ptr);
+  size_t get_pipeline_overruns() { return pipeline_overruns; }
+  const PipelineStats &get_stats() const { return stats; }
+  void set_ddcs(const std::vector<DDCSpec> &specs) { ddc_specs = specs; }
+  void set_sample_buffer_capacity(size_t buffer_ptr, size_t buffer_size);
+  char *get_sample_buffer(size_t buffer_ptr, size_t *buffer_capacity);
+  bool sample_buffer_available();
+  void wait_sample_buffer();
+  void start(const std::string &file, const std::string &fft_file,
+             size_t max_samples_, size_t zlevel, bool useVkFFT_, size_t nfft_,
+             size_t nfft_overlap_, size_t nfft_div, size_t nfft_ds_,
+             size_t rate, size_t batches, size_t sample_id);
+  void stop(size_t overflows);
+  std::string snapshot(double seconds, const std::string &file);
+  void free();
+
+private:
+  void write_snapshot(const std::string &file, uint64_t offset,
+                      uint64_t bytes);
+  void join_snapshots();
+  void free_sample_buffers();
+  void init_sample_buffers();
+  bool dequeue_samples(size_t &read_ptr);
+  void fftin();
+  void fft_in_worker();
+  double chunk_seconds(size_t chunk);
+  std::string time_file(const std::string &file, double seconds);
+  SeekableInfo seekable_info(size_t unit_bytes, double units_per_second,
+                             double seconds);
+  std::string chunk_file(const std::string &file, size_t chunk);
+  void close_writer_async(boost::shared_ptr<SampleWriter> &writer,
+                          size_t overruns);
+  void close_writers();
+  void close_writers_worker();
+  void write_fft_header();
+  void open_sample_writer(size_t chunk);
+  void open_fft_writer(size_t chunk);
+  void write_sample_data(const char *buffer_p, size_t len);
+  void open_burst();
+  void close_burst();
+  void write_triggered_data(const char *buffer_p, size_t len, bool triggered);
+  void open_ddc_writers(size_t chunk);
+  template <typename samp_type>
+  void write_ddc_samples(const samp_type *samples_p, size_t samples);
+  void rotate_fft_writer(size_t chunk);
+  void write_fft_points(const float *points_p, size_t points);
+  void fft_out_offload(const arma::cx_fmat &Pw);
+  void fftout(size_t &fft_read_ptr);
+  void fft_out_worker();
+  void wait_fft_slot();
+  void queue_fft(size_t &fft_write_ptr, size_t frames);
+  void init_fft_slots();
+  void init_hamming_window(size_t nfft);
+  template <typename samp_type>
+  void window_fft_frames(SpecgramFrames<samp_type> &frames,
+                         const char *buffer_p, size_t buffer_capacity,
+                         size_t &fft_write_ptr, size_t &fft_frame,
+                         size_t &curr_nfft_ds);
+  template <typename samp_type>
+  void write_samples(SpecgramFrames<samp_type> &frames, size_t &fft_write_ptr,
+                     size_t &fft_frame, size_t &curr_nfft_ds);
+  template <typename samp_type> void write_samples_worker();
+
+  arma::fvec hammingWindow;
+  arma::fvec hammingWindow2;
+  float hammingWindowSum;
+  size_t nfft, nfft_overlap, nfft_ds, fft_block_samples, fft_slot_frames,
+      max_samples, max_buffer_size, sample_buffers, sample_buffer_alloc_size;
+  bool useVkFFT, fft_reduce, gpu_power_db, gpu_raw_frames;
+  offload_p offload;
+  void (Impl::*write_samples_worker_p)();
+
+  FFTSlot FFTSlots[kFFTbuffers];
+  size_t fft_slots;
+  // FFTSlots are filled in order by write_samples_worker, transformed
+  // in any order by the fft_in_worker threads, and written out in order by
+  // fft_out_worker. A slot is reused only after it has been written out.
+  boost::lockfree::queue<size_t, boost::lockfree::capacity<kFFTbuffers>>
+      in_fft_queue;
+  boost::atomic<bool> fft_slot_done[kFFTbuffers];
+  size_t fft_slots_in;
+  boost::atomic<size_t> fft_slots_out;
+  boost::atomic<size_t> fft_in_workers;
+  // sampleBuffers[sample_buffers] is a discard buffer, received into when
+  // all other buffers are in flight.
+  std::vector<std::pair<char *, size_t>> sampleBuffers;
+  // when each sample buffer was acquired, then enqueued.
+  std::vector<std::chrono::steady_clock::time_point> sample_buffer_times;
+  PipelineStats stats;
+  // Sample buffers and FFT slots are allocated from (hugepage, locked,
+  // optionally NUMA node local) arenas, when their sizes change.
+  BufferArena sample_arena, fft_arena;
+  size_t fft_arena_nfft, fft_arena_frames;
+  bool fft_arena_power_db;
+  boost::scoped_ptr<sample_queue_t> free_sample_queue;
+  boost::scoped_ptr<sample_queue_t> sample_queue;
+  boost::atomic<size_t> pipeline_overruns;
+  // samples_event: sample_queue pushed or input done.
+  // free_samples_event: free_sample_queue pushed.
+  // fft_in_event: in_fft_queue pushed or producer done.
+  // fft_out_event: a slot transformed or all fft_in_workers done.
+  // fft_slot_free_event: a slot written out.
+  PipelineEvent samples_event, free_samples_event, fft_in_event,
+      fft_out_event, fft_slot_free_event;
+  boost::atomic<bool> samples_input_done;
+  boost::atomic<bool> write_samples_worker_done;
+  boost::atomic<bool> fft_in_worker_done;
+  boost::shared_ptr<SampleWriter> sample_writer;
+  boost::shared_ptr<SampleWriter> fft_sample_writer;
+  boost::scoped_ptr<boost::thread_group> writer_threads;
+  // Output is rotated to a new file every rotate_bytes of samples (the FFT
+  // file, at the first FFT slot of each new sample file). Rotated out
+  // writers are closed (compression flushed, and renamed) by
+  // close_writers_worker.
+  size_t rotate_bytes, writer_zlevel, writer_rate;
+  size_t sample_chunk, sample_chunk_bytes, sample_chunk_overruns, fft_chunk,
+      fft_chunk_overruns;
+  size_t fft_slot_chunk[kFFTbuffers];
+  std::string sample_file, fft_sample_file;
+  std::chrono::system_clock::time_point writer_start_time;
+  std::mutex closing_writers_mutex;
+  std::deque<std::pair<boost::shared_ptr<SampleWriter>, size_t>>
+      closing_writers;
+  PipelineEvent closing_writers_event;
+  boost::atomic<bool> closing_writers_done;
+  boost::scoped_ptr<boost::thread> close_writers_thread;
+  FFTEncoder fft_encoder;
+  // Sub-bands are downconverted by the write_samples_worker thread, and
+  // rotated with the sample file (at the next buffer).
+  std::vector<DDCSpec> ddc_specs;
+  std::vector<DDC> ddcs;
+  std::vector<boost::shared_ptr<SampleWriter>> ddc_writers;
+  size_t ddc_chunk, ddc_chunk_overruns;
+  // With a trigger, samples are kept in pre_trigger until a buffer's power
+  // reaches trigger_dbfs, then written to a burst file until hang_bytes
+  // after the last buffer that did. trigger_bytes counts bytes received.
+  SampleRing pre_trigger;
+  bool burst_open;
+  size_t hang_bytes, burst_hang_bytes, trigger_bytes, bursts;
+  // The last history_seconds of samples (whether written or not), pushed
+  // by the write_samples_worker thread. Snapshots of it are written by
+  // their own threads, while the ring is overwritten; history_mutex guards
+  // starting them against start().
+  SampleRing history;
+  std::mutex history_mutex;
+  boost::scoped_ptr<boost::thread_group> snapshot_threads;
+  // only used by fft_out_worker, and reused to avoid allocating per slot.
+  arma::fmat fft_points_out;
+  SpecgramAverage fft_average;
+  std::vector<float> fft_avg_points_out;
+};
+
+SamplePipeline::Impl::Impl()
+    : hammingWindowSum(0), nfft(0), nfft_overlap(0), nfft_ds(0),
+      fft_block_samples(0), fft_slot_frames(0), max_samples(0),
+      max_buffer_size(0), sample_buffers(0), sample_buffer_alloc_size(0),
+      useVkFFT(false), fft_reduce(false), gpu_power_db(false),
+      gpu_raw_frames(false), offload(NULL), write_samples_worker_p(NULL),
+      fft_slots(kFFTbuffers), fft_slots_in(0), fft_slots_out(0),
+      fft_in_workers(0), fft_arena_nfft(0), fft_arena_frames(0),
+      fft_arena_power_db(false), pipeline_overruns(0),
+      samples_input_done(false), write_samples_worker_done(false),
+      fft_in_worker_done(false), rotate_bytes(0), writer_zlevel(0),
+      writer_rate(0), sample_chunk(0), sample_chunk_bytes(0),
+      sample_chunk_overruns(0), fft_chunk(0), fft_chunk_overruns(0),
+      closing_writers_done(false), ddc_chunk(0), ddc_chunk_overruns(0),
+      burst_open(false), hang_bytes(0), burst_hang_bytes(0), trigger_bytes(0),
+      bursts(0) {}
+
+size_t SamplePipeline::Impl::acquire_sample_buffer() {
+  size_t buffer_ptr;
+  if (free_sample_queue->pop(buffer_ptr)) {
+    sample_buffer_times[buffer_ptr] = std::chrono::steady_clock::now();
+    return buffer_ptr;
+  }
+  ++pipeline_overruns;
+  return sample_buffers;
+}
+
+size_t SamplePipeline::Impl::discard_sample_buffer(size_t buffer_ptr) {
+  if (buffer_ptr != sample_buffers) {
+    release_sample_buffer(buffer_ptr);
+    ++pipeline_overruns;
+  }
+  return sample_buffers;
+}
+
+void SamplePipeline::Impl::enqueue_samples(size_t buffer_ptr) {
+  if (buffer_ptr == sample_buffers) {
     return;
   }
+  stats.recv.record_since(sample_buffer_times[buffer_ptr]);
+  sample_buffer_times[buffer_ptr] = std::chrono::steady_clock::now();
+  // the queue has room for every buffer so this should not fail, but if it
+  // does, count an overrun and return the buffer rather than leak it.
+  if (!sample_queue->push(buffer_ptr)) {
+    discard_sample_buffer(buffer_ptr);
+    return;
+  }
+  stats.sample_queue.add();
+  samples_event.notify();
+}
 
-  if (++buffer_ptr == kSampleBuffers) {
-    buffer_ptr = 0;
+void SamplePipeline::Impl::release_sample_buffer(size_t buffer_ptr) {
+  if (buffer_ptr == sample_buffers) {
+    return;
   }
+  set_sample_buffer_capacity(buffer_ptr, max_buffer_size);
+  free_sample_queue->push(buffer_ptr);
+  free_samples_event.notify();
 }
 
-void set_sample_buffer_capacity(size_t buffer_ptr, size_t buffer_size) {
+void SamplePipeline::Impl::set_sample_buffer_capacity(size_t buffer_ptr,
+                                                      size_t buffer_size) {
   sampleBuffers[buffer_ptr].second = buffer_size;
 }
 
-void init_sample_buffers() {
-  for (size_t i = 0; i < kSampleBuffers; ++i) {
-    set_sample_buffer_capacity(i, max_buffer_size);
-    sampleBuffers[i].first = (char *)aligned_alloc(samp_size, max_buffer_size);
-  }
+void SamplePipeline::Impl::free_sample_buffers() {
+  sampleBuffers.clear();
+  sample_arena.release();
+  sample_buffer_alloc_size = 0;
 }
 
-void free_sample_buffers() {
-  for (size_t i = 0; i < kSampleBuffers; ++i) {
-    free(sampleBuffers[i].first);
+// Buffers are kept between captures, and only reallocated if their size
+// or number changes.
+void SamplePipeline::Impl::init_sample_buffers() {
+  // aligned for direct I/O.
+  const size_t alloc_size = (max_buffer_size + kDirectIOAlign - 1) /
+                            kDirectIOAlign * kDirectIOAlign;
+  size_t buffers = kDefaultSampleBuffers;
+  if (buffer_mb) {
+    buffers = std::max(kMinSampleBuffers, (buffer_mb << 20) / alloc_size);
+  }
+  if (alloc_size != sample_buffer_alloc_size || buffers != sample_buffers ||
+      numa_node != sample_arena.numa_node()) {
+    free_sample_buffers();
+    sample_buffers = buffers;
+    sample_buffer_alloc_size = alloc_size;
+    std::cerr << "using " << sample_buffers << " sample buffers of "
+              << alloc_size << " bytes" << std::endl;
+    sampleBuffers.resize(sample_buffers + 1);
+    sample_buffer_times.resize(sample_buffers + 1);
+    sample_arena.set_numa_node(numa_node);
+    for (size_t i = 0; i < sampleBuffers.size(); ++i) {
+      // kBufferArenaAlign is a multiple of kDirectIOAlign.
+      sampleBuffers[i].first =
+          sample_arena.alloc(alloc_size, alloc_size * sampleBuffers.size());
+    }
+    free_sample_queue.reset(new sample_queue_t(sample_buffers));
+    sample_queue.reset(new sample_queue_t(sample_buffers));
+  } else {
+    free_sample_queue->reset();
+    sample_queue->reset();
+  }
+  for (size_t i = 0; i < sample_buffers; ++i) {
+    release_sample_buffer(i);
   }
+  pipeline_overruns = 0;
 }
 
-char *get_sample_buffer(size_t buffer_ptr, size_t *buffer_capacity) {
+char *SamplePipeline::Impl::get_sample_buffer(size_t buffer_ptr,
+                                              size_t *buffer_capacity) {
   if (buffer_capacity) {
     *buffer_capacity = sampleBuffers[buffer_ptr].second;
   }
   return sampleBuffers[buffer_ptr].first;
 }
 
-bool dequeue_samples(size_t &read_ptr) { return sample_queue.pop(read_ptr); }
-
-void specgram_offload(arma::cx_fmat &Pw_in, arma::cx_fmat &Pw) {
-  const size_t nfft_rows = Pw_in.n_rows;
+bool SamplePipeline::Impl::sample_buffer_available() {
+  return free_sample_queue->read_available() > 0;
+}
 
-  for (arma::uword k = 0; k < Pw_in.n_cols; ++k) {
-    Pw.col(k) = arma::fft(Pw_in.col(k), nfft_rows);
+void SamplePipeline::Impl::wait_sample_buffer() {
+  for (;;) {
+    const uint32_t seq = free_samples_event.prepare();
+    if (sample_buffer_available()) {
+      return;
+    }
+    free_samples_event.wait(seq);
   }
 }
 
-inline void fftin() {
+bool SamplePipeline::Impl::dequeue_samples(size_t &read_ptr) {
+  return sample_queue->pop(read_ptr);
+}
+
+void SamplePipeline::Impl::fftin() {
   size_t read_ptr;
   while (in_fft_queue.pop(read_ptr)) {
-    offload(FFTBuffers[read_ptr].first, FFTBuffers[read_ptr].second);
-    while (!out_fft_queue.push(read_ptr)) {
-      usleep(100);
+    stats.in_fft_queue.remove();
+    const auto fft_start = std::chrono::steady_clock::now();
+    FFTSlot &slot = FFTSlots[read_ptr];
+    // FFTW transforms a partial (last) slot zero padded to a full one, so
+    // only the batch size planned in start() is used.
+    size_t frames = slot.frames;
+    if (!useVkFFT && frames < fft_slot_frames) {
+      std::fill(slot.in_p + nfft * frames, slot.in_p + nfft * fft_slot_frames,
+                std::complex<float>(0, 0));
+      frames = fft_slot_frames;
+    }
+    arma::cx_fmat Pw_in(slot.in_p, nfft, frames, false, true);
+    std::unique_lock<std::mutex> vkfft_lock(vkfft_mutex, std::defer_lock);
+    if (useVkFFT) {
+      vkfft_lock.lock();
+    }
+    if (gpu_power_db) {
+      arma::fmat points(slot.points_p, nfft, slot.frames, false, true);
+      vkfft_specgram_power_db(Pw_in, points);
+    } else {
+      arma::cx_fmat Pw(slot.out_p, nfft, frames, false, true);
+      offload(Pw_in, Pw);
     }
+    if (useVkFFT) {
+      vkfft_lock.unlock();
+    }
+    stats.fft.record_since(fft_start);
+    stats.out_fft_queue.add();
+    fft_slot_done[read_ptr] = true;
+    fft_out_event.notify();
   }
 }
 
-void fft_in_worker() {
-  while (!write_samples_worker_done) {
+void SamplePipeline::Impl::fft_in_worker() {
+  for (;;) {
+    const uint32_t seq = fft_in_event.prepare();
+    const bool done = write_samples_worker_done;
     fftin();
-    usleep(10000);
+    if (done) {
+      break;
+    }
+    fft_in_event.wait(seq);
+  }
+  if (--fft_in_workers == 0) {
+    fft_in_worker_done = true;
+    fft_out_event.notify();
   }
-  fftin();
-  fft_in_worker_done = true;
   std::cerr << "fft worker done" << std::endl;
 }
 
-void fft_out_offload(const arma::cx_fmat &Pw) {
-  // TODO: offload C2R
-  arma::fmat fft_points_out =
-      log10(real(Pw % conj(Pw / hammingWindowSum))) * 10;
-  fft_sample_writer->write((const char *)fft_points_out.memptr(),
-                           fft_points_out.n_elem * sizeof(float));
+// Name of the file starting seconds into the capture, from the time (UTC).
+// A file name containing % is a strftime() template, otherwise the file is
+// prefixed with the time.
+std::string SamplePipeline::Impl::time_file(const std::string &file,
+                                            double seconds) {
+  const bool name_template = file.find('%') != std::string::npos;
+  const auto chunk_time =
+      writer_start_time +
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::duration<double>(seconds));
+  const time_t chunk_secs = std::chrono::system_clock::to_time_t(chunk_time);
+  struct tm chunk_tm;
+  gmtime_r(&chunk_secs, &chunk_tm);
+  char name[PATH_MAX];
+  if (name_template) {
+    strftime(name, sizeof(name), file.c_str(), &chunk_tm);
+    boost::filesystem::path parent(boost::filesystem::path(name).parent_path());
+    if (!parent.empty()) {
+      boost::filesystem::create_directories(parent);
+    }
+    return name;
+  }
+  const size_t chunk_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          chunk_time.time_since_epoch())
+          .count() %
+      1000;
+  const size_t len = strftime(name, sizeof(name), "%Y%m%d_%H%M%S", &chunk_tm);
+  snprintf(name + len, sizeof(name) - len, ".%03zu_", chunk_ms);
+  return get_prefix_file(file, name);
 }
 
-void fftout() {
-  size_t read_ptr;
-  while (out_fft_queue.pop(read_ptr)) {
-    fft_out_offload(FFTBuffers[read_ptr].second);
+double SamplePipeline::Impl::chunk_seconds(size_t chunk) {
+  return double(chunk * (rotate_bytes / samp_size)) / writer_rate;
+}
+
+// Name of the file for rotation chunk, from the time of its first sample.
+std::string SamplePipeline::Impl::chunk_file(const std::string &file,
+                                             size_t chunk) {
+  if (!rotate_bytes && file.find('%') == std::string::npos) {
+    return file;
   }
+  return time_file(file, chunk_seconds(chunk));
 }
 
-void fft_out_worker() {
-  while (!fft_in_worker_done) {
-    fftout();
-    usleep(10000);
+// For the index of a seekable file starting seconds into the capture.
+SeekableInfo SamplePipeline::Impl::seekable_info(size_t unit_bytes,
+                                                 double units_per_second,
+                                                 double seconds) {
+  SeekableInfo seekable;
+  seekable.frame_bytes = seekable_frame_bytes;
+  seekable.unit_bytes = unit_bytes;
+  seekable.units_per_second = units_per_second;
+  seekable.start_time =
+      std::chrono::duration<double>(writer_start_time.time_since_epoch())
+          .count() +
+      seconds;
+  return seekable;
+}
+
+void SamplePipeline::Impl::close_writer_async(
+    boost::shared_ptr<SampleWriter> &writer, size_t overruns) {
+  {
+    std::lock_guard<std::mutex> lock(closing_writers_mutex);
+    closing_writers.push_back(std::make_pair(writer, overruns));
+  }
+  writer.reset(new SampleWriter());
+  closing_writers_event.notify();
+}
+
+void SamplePipeline::Impl::close_writers() {
+  for (;;) {
+    std::pair<boost::shared_ptr<SampleWriter>, size_t> closing;
+    {
+      std::lock_guard<std::mutex> lock(closing_writers_mutex);
+      if (closing_writers.empty()) {
+        return;
+      }
+      closing = closing_writers.front();
+      closing_writers.pop_front();
+    }
+    closing.first->close(0, closing.second);
+  }
+}
+
+void SamplePipeline::Impl::close_writers_worker() {
+  for (;;) {
+    const uint32_t seq = closing_writers_event.prepare();
+    const bool done = closing_writers_done;
+    close_writers();
+    if (done) {
+      break;
+    }
+    closing_writers_event.wait(seq);
+  }
+}
+
+void SamplePipeline::Impl::write_fft_header() {
+  nlohmann::json header;
+  header["encoding"] = fft_encoding;
+  if (fft_encoding == "uint8") {
+    header["db_min"] = fft_db_min;
+    header["db_max"] = fft_db_max;
+  }
+  header["bins"] = nfft / fft_bin_decimation;
+  header["bin_decimation"] = fft_bin_decimation;
+  header["bin_decimation_mode"] = fft_bin_max ? "max" : "mean";
+  header["nfft"] = nfft;
+  header["nfft_overlap"] = nfft_overlap;
+  // of each nfft_ds slots of slot_frames frames, only the first is kept.
+  header["nfft_ds"] = nfft_ds;
+  header["slot_frames"] = fft_slot_frames;
+  header["fft_avg"] = fft_avg_mode;
+  header["fft_avg_frames"] = fft_avg_frames;
+  header["fftshift"] = fftshift;
+  header["rate"] = writer_rate;
+  const std::string header_str = fft_file_header(header.dump());
+  fft_sample_writer->write(header_str.data(), header_str.size());
+}
+
+void SamplePipeline::Impl::open_sample_writer(size_t chunk) {
+  size_t prealloc_bytes = prealloc_samples * samp_size;
+  if (rotate_bytes) {
+    prealloc_bytes = std::min(prealloc_bytes, rotate_bytes);
+  }
+  sample_writer->set_seekable(
+      seekable_info(samp_size, writer_rate, chunk_seconds(chunk)));
+  sample_writer->open(chunk_file(sample_file, chunk), writer_zlevel, zthreads,
+                      direct_io, prealloc_bytes, &stats.samples);
+}
+
+void SamplePipeline::Impl::open_fft_writer(size_t chunk) {
+  // FFT frames don't align with rows (after any header), so only index by
+  // byte.
+  fft_sample_writer->set_seekable(seekable_info(1, 0, chunk_seconds(chunk)));
+  fft_sample_writer->open(chunk_file(fft_sample_file, chunk), writer_zlevel,
+                          zthreads, false, 0, &stats.fft_points);
+  write_fft_header();
+}
+
+// Write samples to the current file, rotating to a new file at each
+// rotate_bytes boundary.
+void SamplePipeline::Impl::write_sample_data(const char *buffer_p, size_t len) {
+  while (rotate_bytes && sample_chunk_bytes + len > rotate_bytes) {
+    const size_t chunk_len = rotate_bytes - sample_chunk_bytes;
+    sample_writer->write(buffer_p, chunk_len);
+    buffer_p += chunk_len;
+    len -= chunk_len;
+    ++sample_chunk;
+    sample_chunk_bytes = 0;
+    if (sample_file.size()) {
+      close_writer_async(sample_writer,
+                         pipeline_overruns - sample_chunk_overruns);
+      sample_chunk_overruns = pipeline_overruns;
+      open_sample_writer(sample_chunk);
+    }
+  }
+  sample_writer->write(buffer_p, len);
+  sample_chunk_bytes += len;
+}
+
+// A burst starts with the samples held in pre_trigger, and its file is named
+// for the time of the first of them.
+void SamplePipeline::Impl::open_burst() {
+  ++bursts;
+  burst_open = true;
+  if (sample_file.size()) {
+    const double burst_seconds =
+        double((trigger_bytes - pre_trigger.size()) / samp_size) / writer_rate;
+    sample_writer->set_seekable(
+        seekable_info(samp_size, writer_rate, burst_seconds));
+    sample_writer->open(time_file(sample_file, burst_seconds), writer_zlevel,
+                        zthreads, direct_io, 0, &stats.samples);
+    pre_trigger.read([this](const char *p, size_t len) {
+      sample_writer->write(p, len);
+    });
+  }
+  pre_trigger.clear();
+}
+
+void SamplePipeline::Impl::close_burst() {
+  burst_open = false;
+  if (sample_file.size()) {
+    close_writer_async(sample_writer,
+                       pipeline_overruns - sample_chunk_overruns);
+    sample_chunk_overruns = pipeline_overruns;
+  }
+}
+
+void SamplePipeline::Impl::write_triggered_data(const char *buffer_p,
+                                                size_t len, bool triggered) {
+  if (triggered) {
+    if (!burst_open) {
+      open_burst();
+    }
+    burst_hang_bytes = hang_bytes;
+  } else if (burst_open && !burst_hang_bytes) {
+    close_burst();
+  }
+  if (burst_open) {
+    sample_writer->write(buffer_p, len);
+    if (!triggered) {
+      burst_hang_bytes -= std::min(burst_hang_bytes, len);
+    }
+  } else {
+    pre_trigger.push(buffer_p, len);
+  }
+  trigger_bytes += len;
+}
+
+void SamplePipeline::Impl::open_ddc_writers(size_t chunk) {
+  ddc_chunk = chunk;
+  // DDC output is sc16 for short samples, otherwise fc32.
+  const size_t ddc_samp_size = samp_size == sizeof(std::complex<short>)
+                                   ? sizeof(std::complex<short>)
+                                   : sizeof(std::complex<float>);
+  for (size_t i = 0; i < ddc_writers.size(); ++i) {
+    ddc_writers[i]->set_seekable(seekable_info(
+        ddc_samp_size, ddcs[i].out_rate(), chunk_seconds(chunk)));
+    ddc_writers[i]->open(chunk_file(ddc_specs[i].file, chunk), writer_zlevel,
+                         zthreads, false, 0, &stats.ddc_samples);
+  }
+}
+
+template <typename samp_type>
+void SamplePipeline::Impl::write_ddc_samples(const samp_type *samples_p,
+                                             size_t samples) {
+  const auto ddc_start = std::chrono::steady_clock::now();
+  if (ddc_chunk != sample_chunk) {
+    for (auto &writer : ddc_writers) {
+      close_writer_async(writer, pipeline_overruns - ddc_chunk_overruns);
+    }
+    ddc_chunk_overruns = pipeline_overruns;
+    open_ddc_writers(sample_chunk);
+  }
+  for (size_t i = 0; i < ddcs.size(); ++i) {
+    size_t bytes;
+    const char *ddc_p = ddcs[i].process(samples_p, samples, &bytes);
+    ddc_writers[i]->write(ddc_p, bytes);
+  }
+  stats.ddc.record_since(ddc_start);
+}
+
+void SamplePipeline::Impl::rotate_fft_writer(size_t chunk) {
+  fft_chunk = chunk;
+  if (fft_sample_file.size()) {
+    close_writer_async(fft_sample_writer,
+                       pipeline_overruns - fft_chunk_overruns);
+    fft_chunk_overruns = pipeline_overruns;
+    open_fft_writer(fft_chunk);
+  }
+}
+
+void SamplePipeline::Impl::write_fft_points(const float *points_p,
+                                            size_t points) {
+  size_t bytes;
+  const char *encoded_p = fft_encoder.encode(points_p, points, &bytes);
+  fft_sample_writer->write(encoded_p, bytes);
+}
+
+void SamplePipeline::Impl::fft_out_offload(const arma::cx_fmat &Pw) {
+  if (fft_reduce) {
+    fft_average.add(Pw, fft_avg_points_out);
+    write_fft_points(fft_avg_points_out.data(), fft_avg_points_out.size());
+  } else {
+    specgram_power_db(Pw, hammingWindowSum, fft_points_out, fftshift);
+    write_fft_points(fft_points_out.memptr(), fft_points_out.n_elem);
+  }
+}
+
+// Write out transformed slots in the order they were queued, stopping at the
+// first slot still being transformed.
+void SamplePipeline::Impl::fftout(size_t &fft_read_ptr) {
+  while (fft_slot_done[fft_read_ptr]) {
+    fft_slot_done[fft_read_ptr] = false;
+    stats.out_fft_queue.remove();
+    const auto fft_out_start = std::chrono::steady_clock::now();
+    if (fft_slot_chunk[fft_read_ptr] != fft_chunk) {
+      rotate_fft_writer(fft_slot_chunk[fft_read_ptr]);
+    }
+    const FFTSlot &slot = FFTSlots[fft_read_ptr];
+    if (gpu_power_db) {
+      write_fft_points(slot.points_p, nfft * slot.frames);
+    } else {
+      fft_out_offload(
+          arma::cx_fmat(slot.out_p, nfft, slot.frames, false, true));
+    }
+    stats.fft_out.record_since(fft_out_start);
+    ++fft_slots_out;
+    fft_slot_free_event.notify();
+    if (++fft_read_ptr == fft_slots) {
+      fft_read_ptr = 0;
+    }
   }
-  fftout();
-  std::cerr << "fft out worker done" << std::endl;
 }
 
-void specgram_window(arma::cx_fmat &Pw_in, const arma::uword Nfft,
-                     const arma::uword Noverl) {
-  arma::uword N = fft_samples_in.size();
-  arma::uword D = Nfft - Noverl;
-  arma::uword m = 0;
-  const arma::uword U =
-      static_cast<arma::uword>(floor((N - Noverl) / double(D)));
-  Pw_in.set_size(Nfft, U);
+void SamplePipeline::Impl::fft_out_worker() {
+  size_t fft_read_ptr = 0;
 
-  for (arma::uword k = 0; k <= N - Nfft; k += D) {
-    Pw_in.col(m++) = fft_samples_in.rows(k, k + Nfft - 1) % hammingWindow;
+  for (;;) {
+    const uint32_t seq = fft_out_event.prepare();
+    const bool done = fft_in_worker_done;
+    fftout(fft_read_ptr);
+    if (done) {
+      break;
+    }
+    fft_out_event.wait(seq);
   }
+  std::cerr << "fft out worker done" << std::endl;
 }
 
-void queue_fft(size_t &fft_write_ptr) {
-  arma::cx_fmat &Pw_in = FFTBuffers[fft_write_ptr].first;
-  specgram_window(Pw_in, nfft, nfft_overlap);
-  arma::cx_fmat &Pw = FFTBuffers[fft_write_ptr].second;
-  Pw.copy_size(Pw_in);
-  while (!in_fft_queue.push(fft_write_ptr)) {
-    usleep(100);
+void SamplePipeline::Impl::wait_fft_slot() {
+  for (;;) {
+    const uint32_t seq = fft_slot_free_event.prepare();
+    if (fft_slots_in - fft_slots_out < fft_slots) {
+      return;
+    }
+    fft_slot_free_event.wait(seq);
   }
-  if (++fft_write_ptr == kFFTbuffers) {
+}
+
+void SamplePipeline::Impl::queue_fft(size_t &fft_write_ptr, size_t frames) {
+  FFTSlots[fft_write_ptr].frames = frames;
+  stats.in_fft_queue.add();
+  // cannot fail, as at most fft_slots slots are in flight.
+  in_fft_queue.push(fft_write_ptr);
+  ++fft_slots_in;
+  fft_in_event.notify();
+  if (++fft_write_ptr == fft_slots) {
     fft_write_ptr = 0;
   }
 }
 
-void init_hamming_window(size_t nfft) {
+// FFT slots are kept between captures, and only reallocated if their size
+// or contents change.
+void SamplePipeline::Impl::init_fft_slots() {
+  if (!nfft || (nfft == fft_arena_nfft && fft_slot_frames == fft_arena_frames &&
+                gpu_power_db == fft_arena_power_db &&
+                numa_node == fft_arena.numa_node())) {
+    return;
+  }
+  fft_arena.release();
+  fft_arena.set_numa_node(numa_node);
+  fft_arena_nfft = nfft;
+  fft_arena_frames = fft_slot_frames;
+  fft_arena_power_db = gpu_power_db;
+  const size_t slot_samples = nfft * fft_slot_frames;
+  const size_t in_size = slot_samples * sizeof(std::complex<float>);
+  const size_t out_size =
+      gpu_power_db ? slot_samples * sizeof(float) : in_size;
+  const size_t align = kBufferArenaAlign;
+  const size_t slot_size = (in_size + align - 1) / align * align +
+                           (out_size + align - 1) / align * align;
+  fft_slots = std::min(std::max(kFFTSlotsBytes / slot_size, kMinFFTSlots),
+                       kFFTbuffers);
+  const size_t arena_size = fft_slots * slot_size;
+  for (size_t i = 0; i < fft_slots; ++i) {
+    FFTSlot &slot = FFTSlots[i];
+    slot.in_p = (std::complex<float> *)fft_arena.alloc(in_size, arena_size);
+    char *out_p = fft_arena.alloc(out_size, arena_size);
+    slot.out_p = gpu_power_db ? NULL : (std::complex<float> *)out_p;
+    slot.points_p = gpu_power_db ? (float *)out_p : NULL;
+    slot.frames = 0;
+  }
+  std::cerr << "using " << fft_slots << " FFT slots of " << slot_size
+            << " bytes" << std::endl;
+}
+
+void SamplePipeline::Impl::init_hamming_window(size_t nfft) {
   hammingWindow = arma::conv_to<arma::fvec>::from(sp::hamming(nfft));
+  hammingWindow2 = interleave_window(hammingWindow);
   hammingWindowSum = sum(hammingWindow);
 }
 
+// Window each frame into the next column of the current FFT slot, queueing
+// the slot when it is full. Only every nfft_ds'th slot is kept; frames of
+// other slots just advance the frame position.
 template <typename samp_type>
-void write_samples(size_t &fft_write_ptr, size_t &curr_nfft_ds) {
+void SamplePipeline::Impl::window_fft_frames(SpecgramFrames<samp_type> &frames,
+                                             const char *buffer_p,
+                                             size_t buffer_capacity,
+                                             size_t &fft_write_ptr,
+                                             size_t &fft_frame,
+                                             size_t &curr_nfft_ds) {
+  frames.set_buffer((const samp_type *)buffer_p,
+                    buffer_capacity / sizeof(samp_type));
+  const samp_type *frame_p;
+  while ((frame_p = frames.next())) {
+    if (!curr_nfft_ds) {
+      std::complex<float> *in_p = FFTSlots[fft_write_ptr].in_p;
+      if (!fft_frame) {
+        wait_fft_slot();
+        fft_slot_chunk[fft_write_ptr] = sample_chunk;
+      }
+      if (gpu_raw_frames) {
+        memcpy((char *)in_p + fft_frame * nfft * sizeof(samp_type), frame_p,
+               nfft * sizeof(samp_type));
+      } else {
+        window_samples(frame_p, in_p + fft_frame * nfft,
+                       hammingWindow2.memptr(), nfft, 1);
+      }
+    }
+    if (++fft_frame == fft_slot_frames) {
+      fft_frame = 0;
+      if (!curr_nfft_ds) {
+        queue_fft(fft_write_ptr, fft_slot_frames);
+      }
+      if (++curr_nfft_ds == nfft_ds) {
+        curr_nfft_ds = 0;
+      }
+    }
+  }
+}
+
+template <typename samp_type>
+void SamplePipeline::Impl::write_samples(SpecgramFrames<samp_type> &frames,
+                                         size_t &fft_write_ptr,
+                                         size_t &fft_frame,
+                                         size_t &curr_nfft_ds) {
   size_t read_ptr;
   size_t buffer_capacity = 0;
   while (dequeue_samples(read_ptr)) {
+    stats.sample_queue.remove();
+    stats.queue.record_since(sample_buffer_times[read_ptr]);
     char *buffer_p = get_sample_buffer(read_ptr, &buffer_capacity);
     if (nfft) {
-      samp_type *i_p = (samp_type *)buffer_p;
-      for (size_t i = 0;
-           i < buffer_capacity / (fft_samples_in.size() * sizeof(samp_type));
-           ++i) {
-        for (size_t fft_p = 0; fft_p < fft_samples_in.size(); ++fft_p, ++i_p) {
-          fft_samples_in[fft_p] = std::complex<float>(i_p->real(), i_p->imag());
-        }
-        if (++curr_nfft_ds == nfft_ds) {
-          curr_nfft_ds = 0;
-          queue_fft(fft_write_ptr);
-        }
-      }
+      const auto window_start = std::chrono::steady_clock::now();
+      window_fft_frames(frames, buffer_p, buffer_capacity, fft_write_ptr,
+                        fft_frame, curr_nfft_ds);
+      stats.window.record_since(window_start);
+    }
+    const auto write_start = std::chrono::steady_clock::now();
+    if (trigger) {
+      const float power_db =
+          sample_power_db((const samp_type *)buffer_p,
+                          buffer_capacity / sizeof(samp_type));
+      write_triggered_data(buffer_p, buffer_capacity,
+                           power_db >= trigger_dbfs);
+    } else {
+      write_sample_data(buffer_p, buffer_capacity);
     }
-    sample_writer->write(buffer_p, buffer_capacity);
-    std::cerr << "." << std::endl;
+    stats.write.record_since(write_start);
+    if (!ddcs.empty()) {
+      write_ddc_samples((const samp_type *)buffer_p,
+                        buffer_capacity / sizeof(samp_type));
+    }
+    history.push(buffer_p, buffer_capacity);
+    release_sample_buffer(read_ptr);
   }
 }
 
-void write_samples_worker() {
+template <typename samp_type>
+void SamplePipeline::Impl::write_samples_worker() {
+  SpecgramFrames<samp_type> frames;
   size_t fft_write_ptr = 0;
+  size_t fft_frame = 0;
   size_t curr_nfft_ds = 0;
+  frames.reset(nfft, nfft_overlap);
 
-  while (!samples_input_done) {
-    write_samples_p(fft_write_ptr, curr_nfft_ds);
-    usleep(10000);
+  for (;;) {
+    const uint32_t seq = samples_event.prepare();
+    const bool done = samples_input_done;
+    write_samples(frames, fft_write_ptr, fft_frame, curr_nfft_ds);
+    if (done) {
+      break;
+    }
+    samples_event.wait(seq);
+  }
+  if (fft_frame && !curr_nfft_ds) {
+    // flush the last, partial slot.
+    queue_fft(fft_write_ptr, fft_frame);
   }
-
-  write_samples_p(fft_write_ptr, curr_nfft_ds);
   write_samples_worker_done = true;
+  fft_in_event.notify();
   std::cerr << "write samples worker done" << std::endl;
 }
 
+void SamplePipeline::Impl::start(const std::string &file,
+                                 const std::string &fft_file,
+                                 size_t max_samples_, size_t zlevel,
+                                 bool useVkFFT_, size_t nfft_,
+                                 size_t nfft_overlap_, size_t nfft_div,
+                                 size_t nfft_ds_, size_t rate, size_t batches,
+                                 size_t sample_id) {
+  // before anything is set up, so an invalid request leaves nothing running.
+  check_sample_pipeline_fft(nfft_, nfft_overlap_, fft_bin_decimation);
+  nfft = nfft_;
+  nfft_overlap = nfft_overlap_;
+  nfft_ds = nfft_ds_;
+  useVkFFT = useVkFFT_;
+
+  if (samp_type_name == "double") {
+    write_samples_worker_p = &Impl::write_samples_worker<std::complex<double>>;
+  } else if (samp_type_name == "float") {
+    write_samples_worker_p = &Impl::write_samples_worker<std::complex<float>>;
+  } else {
+    write_samples_worker_p = &Impl::write_samples_worker<std::complex<short>>;
+  }
+  fft_block_samples = rate / nfft_div;
+  // each FFT slot holds the frames starting in fft_block_samples.
+  if (nfft) {
+    fft_slot_frames =
+        std::max(fft_block_samples / (nfft - nfft_overlap), size_t(1));
+  }
+  offload = specgram_offload;
+  if (useVkFFT) {
+    std::lock_guard<std::mutex> lock(vkfft_mutex);
+    if (vkfft_ready && (batches != vkfft_batches || nfft != vkfft_nfft ||
+                        sample_id != vkfft_sample_id)) {
+      free_vkfft();
+      vkfft_ready = false;
+    }
+    if (!vkfft_ready) {
+      const int64_t res =
+          init_vkfft(batches, nfft, sample_id, vkfft_cache_dir);
+      if (res) {
+        // release whatever was set up, and retry on the next start.
+        free_vkfft();
+        std::cerr << "vkFFT initialization failed (" << res
+                  << "), using FFTW" << std::endl;
+        useVkFFT = false;
+      } else {
+        vkfft_ready = true;
+        vkfft_batches = batches;
+        vkfft_nfft = nfft;
+        vkfft_sample_id = sample_id;
+      }
+    }
+    if (useVkFFT) {
+      offload = vkfft_specgram_offload;
+    }
+  }
+  if (!useVkFFT && nfft) {
+    if (fftw_wisdom_loaded != fftw_wisdom_file) {
+      specgram_load_wisdom(fftw_wisdom_file);
+      fftw_wisdom_loaded = fftw_wisdom_file;
+    }
+    specgram_plan(nfft, fft_slot_frames);
+  }
+  max_samples = max_samples_;
+  max_buffer_size = max_samples * samp_size;
+  init_sample_buffers();
+  init_hamming_window(nfft);
+  fft_reduce = fft_avg_mode != "none" || fft_bin_decimation > 1;
+  // averaging and bin decimation need the power of each bin, so only
+  // compute dB points on the GPU without them. Double samples are windowed
+  // (and converted to float) on the host.
+  gpu_power_db = useVkFFT && nfft && !fft_reduce;
+  gpu_raw_frames =
+      gpu_power_db && samp_size != sizeof(std::complex<double>);
+  init_fft_slots();
+  if (useVkFFT) {
+    std::lock_guard<std::mutex> lock(vkfft_mutex);
+    vkfft_set_power_db(gpu_power_db, hammingWindow,
+                       gpu_raw_frames ? samp_size : 0, hammingWindowSum,
+                       fftshift);
+  }
+  if (fft_reduce) {
+    if (fft_avg_mode == "none") {
+      fft_average.reset("mean", nfft, 1, fft_bin_decimation, fft_bin_max,
+                        hammingWindowSum, fftshift);
+    } else {
+      fft_average.reset(fft_avg_mode, nfft, fft_avg_frames,
+                        fft_bin_decimation, fft_bin_max, hammingWindowSum,
+                        fftshift);
+    }
+  }
+  fft_encoder.reset(fft_encoding, fft_db_min, fft_db_max);
+  stats.reset();
+  stats.sample_buffers = sample_buffers;
+  stats.fft_slots = nfft ? fft_slots : 0;
+  samples_input_done = false;
+  write_samples_worker_done = false;
+  fft_in_worker_done = false;
+  fft_slots_in = 0;
+  fft_slots_out = 0;
+  for (size_t i = 0; i < kFFTbuffers; ++i) {
+    fft_slot_done[i] = false;
+  }
+  // All pipelines share one vkFFT context (its plan and device buffers), so
+  // vkFFT transforms are serialized by vkfft_mutex, and extra workers would
+  // only wait on it (and on the slot ring) rather than run in parallel.
+  size_t fft_workers = useVkFFT ? 1 : fft_threads;
+  fft_in_workers = fft_workers;
+  rotate_bytes = rotate_bytes_option;
+  if (rotate_seconds) {
+    const size_t seconds_bytes = rotate_seconds * rate * samp_size;
+    rotate_bytes = rotate_bytes ? std::min(rotate_bytes, seconds_bytes)
+                                : seconds_bytes;
+  }
+  // rotate on whole samples.
+  rotate_bytes -= rotate_bytes % samp_size;
+  if (trigger && rotate_bytes) {
+    std::cerr << "not rotating output, bursts are written to their own files"
+              << std::endl;
+    rotate_bytes = 0;
+  }
+  if (rotate_bytes) {
+    std::cerr << "rotating output every " << rotate_bytes << " bytes"
+              << std::endl;
+  }
+  {
+    // snapshots read the history ring and writer parameters.
+    std::lock_guard<std::mutex> lock(history_mutex);
+    join_snapshots();
+    history.reset(size_t(history_seconds * rate) * samp_size, numa_node);
+    writer_zlevel = zlevel;
+    writer_rate = rate;
+    writer_start_time = std::chrono::system_clock::now();
+  }
+  sample_file = file;
+  fft_sample_file = fft_file;
+  sample_chunk = 0;
+  sample_chunk_bytes = 0;
+  sample_chunk_overruns = 0;
+  fft_chunk = 0;
+  fft_chunk_overruns = 0;
+  sample_writer.reset(new SampleWriter());
+  fft_sample_writer.reset(new SampleWriter());
+  if (trigger) {
+    const size_t pre_samples = trigger_pre_seconds * rate;
+    pre_trigger.reset(pre_samples * samp_size, numa_node);
+    hang_bytes = size_t(trigger_hang_seconds * rate) * samp_size;
+    burst_open = false;
+    burst_hang_bytes = 0;
+    trigger_bytes = 0;
+    bursts = 0;
+    std::cerr << "triggering at " << trigger_dbfs << " dBFS, with "
+              << pre_samples << " samples before" << std::endl;
+  } else if (sample_file.size()) {
+    open_sample_writer(0);
+  }
+  if (fft_sample_file.size()) {
+    open_fft_writer(0);
+  }
+  ddcs.resize(ddc_specs.size());
+  ddc_writers.clear();
+  for (size_t i = 0; i < ddc_specs.size(); ++i) {
+    const DDCSpec &spec = ddc_specs[i];
+    ddcs[i].reset(rate, spec.freq, spec.bw);
+    ddc_writers.push_back(
+        boost::shared_ptr<SampleWriter>(new SampleWriter()));
+    std::cerr << "DDC " << spec.freq << " Hz (" << spec.bw
+              << " Hz bandwidth) decimated by " << ddcs[i].decimation()
+              << " to " << ddcs[i].out_rate() << " samples/s" << std::endl;
+  }
+  ddc_chunk_overruns = 0;
+  open_ddc_writers(0);
+  closing_writers_done = false;
+  close_writers_thread.reset(
+      new boost::thread(&Impl::close_writers_worker, this));
+  writer_threads.reset(new boost::thread_group());
+  writer_threads->add_thread(new boost::thread(write_samples_worker_p, this));
+  for (size_t i = 0; i < fft_workers; ++i) {
+    writer_threads->add_thread(new boost::thread(&Impl::fft_in_worker, this));
+  }
+  writer_threads->add_thread(new boost::thread(&Impl::fft_out_worker, this));
+}
+
+void SamplePipeline::Impl::stop(size_t overflows) {
+  samples_input_done = true;
+  samples_event.notify();
+  writer_threads->join_all();
+  if (pipeline_overruns) {
+    std::cerr << pipeline_overruns
+              << " pipeline overruns (sample buffers dropped)" << std::endl;
+  }
+  if (trigger) {
+    std::cerr << bursts << " bursts triggered" << std::endl;
+  }
+  sample_writer->close(overflows, pipeline_overruns - sample_chunk_overruns);
+  fft_sample_writer->close(overflows, pipeline_overruns - fft_chunk_overruns);
+  for (auto &writer : ddc_writers) {
+    writer->close(overflows, pipeline_overruns - ddc_chunk_overruns);
+  }
+  closing_writers_done = true;
+  closing_writers_event.notify();
+  close_writers_thread->join();
+  if (useVkFFT) {
+    std::lock_guard<std::mutex> lock(vkfft_mutex);
+    log_vkfft_timings();
+  } else {
+    specgram_save_wisdom(fftw_wisdom_file);
+  }
+}
+
+void SamplePipeline::Impl::join_snapshots() {
+  if (snapshot_threads) {
+    snapshot_threads->join_all();
+  }
+  snapshot_threads.reset(new boost::thread_group());
+}
+
+// Copy the snapshot out of the history ring a chunk at a time (so the
+// write_samples_worker thread is never held up), stopping if the ring
+// overwrites it first.
+void SamplePipeline::Impl::write_snapshot(const std::string &file,
+                                          uint64_t offset, uint64_t bytes) {
+  SampleWriter writer;
+  writer.set_seekable(seekable_info(samp_size, writer_rate,
+                                    double(offset / samp_size) / writer_rate));
+  writer.open(file, writer_zlevel, 0, false, 0, NULL);
+  std::vector<char> chunk(kSnapshotChunk);
+  for (uint64_t end = offset + bytes; offset < end;) {
+    const size_t len = std::min(uint64_t(chunk.size()), end - offset);
+    if (!history.copy(offset, len, chunk.data())) {
+      std::cerr << "snapshot " << file << " truncated, "
+                << end - offset << " bytes overwritten before written"
+                << std::endl;
+      break;
+    }
+    writer.write(chunk.data(), len);
+    offset += len;
+  }
+  writer.close(0);
+  std::cerr << "snapshot " << file << " written" << std::endl;
+}
+
+// Write the last seconds of samples in the history ring to file (named for
+// the time of its first sample, like a rotated file) in the background.
+// Returns the file name, or "" if there are no samples.
+std::string SamplePipeline::Impl::snapshot(double seconds,
+                                           const std::string &file) {
+  std::lock_guard<std::mutex> lock(history_mutex);
+  const uint64_t end = history.end();
+  const uint64_t bytes = std::min(
+      uint64_t(seconds * writer_rate) * samp_size, end - history.begin());
+  if (!bytes || file.empty()) {
+    return "";
+  }
+  const std::string snapshot_file =
+      time_file(file, double((end - bytes) / samp_size) / writer_rate);
+  std::cerr << "snapshot of " << double(bytes / samp_size) / writer_rate
+            << "s to " << snapshot_file << std::endl;
+  snapshot_threads->create_thread([this, snapshot_file, end, bytes] {
+    write_snapshot(snapshot_file, end - bytes, bytes);
+  });
+  return snapshot_file;
+}
+
+void SamplePipeline::Impl::free() {
+  {
+    std::lock_guard<std::mutex> lock(history_mutex);
+    join_snapshots();
+    history.reset(0, -1);
+  }
+  free_sample_buffers();
+  sample_queue.reset();
+  free_sample_queue.reset();
+  fft_arena.release();
+  fft_arena_nfft = 0;
+  pre_trigger.reset(0, -1);
+}
+
+SamplePipeline::SamplePipeline() : impl_(new Impl()) {}
+
+SamplePipeline::~SamplePipeline() {}
+
+void SamplePipeline::set_sample_buffer_capacity(size_t buffer_ptr,
+                                                size_t buffer_size) {
+  impl_->set_sample_buffer_capacity(buffer_ptr, buffer_size);
+}
+
+char *SamplePipeline::get_sample_buffer(size_t buffer_ptr,
+                                        size_t *buffer_capacity) {
+  return impl_->get_sample_buffer(buffer_ptr, buffer_capacity);
+}
+
+size_t SamplePipeline::acquire_sample_buffer() {
+  return impl_->acquire_sample_buffer();
+}
+
+size_t SamplePipeline::discard_sample_buffer(size_t buffer_ptr) {
+  return impl_->discard_sample_buffer(buffer_ptr);
+}
+
+void SamplePipeline::enqueue_samples(size_t buffer_ptr) {
+  impl_->enqueue_samples(buffer_ptr);
+}
+
+bool SamplePipeline::sample_buffer_available() {
+  return impl_->sample_buffer_available();
+}
+
+void SamplePipeline::wait_sample_buffer() { impl_->wait_sample_buffer(); }
+
+size_t SamplePipeline::get_pipeline_overruns() {
+  return impl_->get_pipeline_overruns();
+}
+
+const PipelineStats &SamplePipeline::get_stats() const {
+  return impl_->get_stats();
+}
+
+void SamplePipeline::set_ddcs(const std::vector<DDCSpec> &specs) {
+  impl_->set_ddcs(specs);
+}
+
+void SamplePipeline::start(const std::string &file,
+                           const std::string &fft_file, size_t max_samples_,
+                           size_t zlevel, bool useVkFFT_, size_t nfft_,
+                           size_t nfft_overlap_, size_t nfft_div,
+                           size_t nfft_ds_, size_t rate, size_t batches,
+                           size_t sample_id) {
+  impl_->start(file, fft_file, max_samples_, zlevel, useVkFFT_, nfft_,
+               nfft_overlap_, nfft_div, nfft_ds_, rate, batches, sample_id);
+}
+
+void SamplePipeline::stop(size_t overflows) { impl_->stop(overflows); }
+
+std::string SamplePipeline::snapshot(double seconds, const std::string &file) {
+  return impl_->snapshot(seconds, file);
+}
+
+void SamplePipeline::free() { impl_->free(); }
+
+static std::vector<boost::shared_ptr<SamplePipeline>> sample_pipelines;
+
+SamplePipeline &get_sample_pipeline(size_t n) {
+  while (sample_pipelines.size() <= n) {
+    sample_pipelines.push_back(boost::shared_ptr<SamplePipeline>(
+        new SamplePipeline()));
+  }
+  return *sample_pipelines[n];
+}
+
+size_t acquire_sample_buffer() {
+  return get_sample_pipeline(0).acquire_sample_buffer();
+}
+
+void enqueue_samples(size_t buffer_ptr) {
+  get_sample_pipeline(0).enqueue_samples(buffer_ptr);
+}
+
+size_t get_pipeline_overruns() {
+  return get_sample_pipeline(0).get_pipeline_overruns();
+}
+
+void set_sample_buffer_capacity(size_t buffer_ptr, size_t buffer_size) {
+  get_sample_pipeline(0).set_sample_buffer_capacity(buffer_ptr, buffer_size);
+}
+
+char *get_sample_buffer(size_t buffer_ptr, size_t *buffer_capacity) {
+  return get_sample_pipeline(0).get_sample_buffer(buffer_ptr,
+                                                  buffer_capacity);
+}
+
+bool sample_buffer_available() {
+  return get_sample_pipeline(0).sample_buffer_available();
+}
+
+void wait_sample_buffer() { get_sample_pipeline(0).wait_sample_buffer(); }
+
 size_t get_samp_size() { return samp_size; }
 
 void set_sample_pipeline_types(const std::string &type,
                                std::string &cpu_format) {
   if (type == "double") {
-    write_samples_p = &write_samples<std::complex<double>>;
     samp_size = sizeof(std::complex<double>);
     cpu_format = "fc64";
   } else if (type == "float") {
-    write_samples_p = &write_samples<std::complex<float>>;
     samp_size = sizeof(std::complex<float>);
     cpu_format = "fc32";
   } else if (type == "short") {
-    write_samples_p = &write_samples<std::complex<short>>;
     samp_size = sizeof(std::complex<short>);
     cpu_format = "sc16";
   } else {
     throw std::runtime_error("Unknown type " + type);
   }
+  samp_type_name = type;
+}
+
+void check_sample_pipeline_fft(size_t nfft, size_t nfft_overlap,
+                               size_t bin_decimation) {
+  if (nfft && nfft_overlap >= nfft) {
+    throw std::runtime_error("nfft_overlap must be less than nfft");
+  }
+  if (nfft && bin_decimation && nfft % bin_decimation) {
+    throw std::runtime_error("fft_bin_decimation must be a factor of nfft");
+  }
+}
+
+void set_sample_pipeline_zthreads(size_t zthreads_) { zthreads = zthreads_; }
+
+void set_sample_pipeline_direct_io(bool direct_io_) { direct_io = direct_io_; }
+
+void set_sample_pipeline_numa_node(int numa_node_) { numa_node = numa_node_; }
+
+void set_sample_pipeline_fft_threads(size_t fft_threads_) {
+  fft_threads = std::max(fft_threads_, size_t(1));
+}
+
+void set_sample_pipeline_fftshift(bool fftshift_) { fftshift = fftshift_; }
+
+void set_sample_pipeline_fft_avg(const std::string &mode, size_t frames) {
+  // check the mode now, rather than at start.
+  if (mode != "none" && mode != "mean" && mode != "max" && mode != "min" &&
+      mode != "ema") {
+    throw std::runtime_error("Unknown FFT average mode " + mode);
+  }
+  fft_avg_mode = mode;
+  fft_avg_frames = frames;
+}
+
+void set_sample_pipeline_fft_encoding(const std::string &encoding,
+                                      float db_min, float db_max,
+                                      size_t bin_decimation, bool bin_max) {
+  // check the encoding now, rather than at start.
+  FFTEncoder().reset(encoding, db_min, db_max);
+  fft_encoding = encoding;
+  fft_db_min = db_min;
+  fft_db_max = db_max;
+  fft_bin_decimation = std::max(bin_decimation, size_t(1));
+  fft_bin_max = bin_max;
+}
+
+void set_sample_pipeline_rotate(double seconds, size_t bytes) {
+  rotate_seconds = seconds;
+  rotate_bytes_option = bytes;
+}
+
+void set_sample_pipeline_trigger(bool trigger_, double dbfs,
+                                 double pre_seconds, double hang_seconds) {
+  trigger = trigger_;
+  trigger_dbfs = dbfs;
+  trigger_pre_seconds = pre_seconds;
+  trigger_hang_seconds = hang_seconds;
+}
+
+void set_sample_pipeline_history(double seconds) { history_seconds = seconds; }
+
+void set_sample_pipeline_seekable_frame_bytes(size_t frame_bytes) {
+  seekable_frame_bytes = frame_bytes;
+}
+
+void set_sample_pipeline_ddcs(const std::vector<DDCSpec> &specs) {
+  get_sample_pipeline(0).set_ddcs(specs);
+}
+
+void set_sample_pipeline_buffer_mb(size_t buffer_mb_) {
+  buffer_mb = buffer_mb_;
+}
+
+void set_sample_pipeline_fftw_wisdom(const std::string &wisdom_file) {
+  fftw_wisdom_file = wisdom_file;
+}
+
+void set_sample_pipeline_vkfft_cache_dir(const std::string &cache_dir) {
+  vkfft_cache_dir = cache_dir;
+}
+
+void set_sample_pipeline_prealloc_samples(size_t prealloc_samples_) {
+  prealloc_samples = prealloc_samples_;
 }
 
 void sample_pipeline_start(const std::string &file, const std::string &fft_file,
@@ -228,45 +1376,23 @@ void sample_pipeline_start(const std::string &file, const std::string &fft_file,
                            size_t nfft_, size_t nfft_overlap_, size_t nfft_div,
                            size_t nfft_ds_, size_t rate, size_t batches,
                            size_t sample_id) {
-  nfft = nfft_;
-  nfft_overlap_ = nfft_overlap_;
-  nfft_ds = nfft_ds_;
-  useVkFFT = useVkFFT_;
-
-  offload = specgram_offload;
-  if (useVkFFT) {
-    offload = vkfft_specgram_offload;
-    init_vkfft(batches, nfft, sample_id);
-  }
-  max_samples = max_samples_;
-  max_buffer_size = max_samples * samp_size;
-  init_sample_buffers();
-  init_hamming_window(nfft);
-  fft_samples_in.set_size(rate / nfft_div);
-  samples_input_done = false;
-  write_samples_worker_done = false;
-  fft_in_worker_done = false;
-  sample_writer.reset(new SampleWriter());
-  fft_sample_writer.reset(new SampleWriter());
-  if (file.size()) {
-    sample_writer->open(file, zlevel);
-  }
-  if (fft_file.size()) {
-    fft_sample_writer->open(fft_file, zlevel);
-  }
-  writer_threads.reset(new boost::thread_group());
-  writer_threads->add_thread(new boost::thread(write_samples_worker));
-  writer_threads->add_thread(new boost::thread(fft_in_worker));
-  writer_threads->add_thread(new boost::thread(fft_out_worker));
+  get_sample_pipeline(0).start(file, fft_file, max_samples_, zlevel,
+                               useVkFFT_, nfft_, nfft_overlap_, nfft_div,
+                               nfft_ds_, rate, batches, sample_id);
 }
 
 void sample_pipeline_stop(size_t overflows) {
-  samples_input_done = true;
-  writer_threads->join_all();
-  sample_writer->close(overflows);
-  fft_sample_writer->close(overflows);
-  if (useVkFFT) {
+  get_sample_pipeline(0).stop(overflows);
+}
+
+void sample_pipeline_free() {
+  std::lock_guard<std::mutex> lock(vkfft_mutex);
+  if (vkfft_ready) {
     free_vkfft();
+    vkfft_ready = false;
   }
-  free_sample_buffers();
+  for (auto &pipeline : sample_pipelines) {
+    pipeline->free();
+  }
+  specgram_free_plans();
 }
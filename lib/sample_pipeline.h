@@ -1,9 +1,69 @@
+#include <boost/scoped_ptr.hpp>
 #include <cstddef>
 #include <string>
 
+#include "ddc.h"
+#include "pipeline_stats.h"
+
+#ifndef SAMPLE_PIPELINE_H
+#define SAMPLE_PIPELINE_H 1
+// A pipeline from sample buffers to sample and FFT files, with its own
+// buffers, writer thread and FFT workers. Pipelines share the configuration
+// set by set_sample_pipeline_*() (and vkFFT, which they take turns to use),
+// so several can record channels side by side.
+class SamplePipeline {
+public:
+  SamplePipeline();
+  ~SamplePipeline();
+  void set_sample_buffer_capacity(size_t buffer_ptr, size_t buffer_size);
+  char *get_sample_buffer(size_t buffer_ptr, size_t *buffer_capacity);
+  // Returns a free sample buffer, or if none are free counts a pipeline
+  // overrun and returns a discard buffer (whose samples enqueue_samples()
+  // drops).
+  size_t acquire_sample_buffer();
+  // Returns an acquired buffer unused, counting a pipeline overrun, and
+  // returns the discard buffer (so another pipeline's overrun can be
+  // matched, keeping their samples aligned).
+  size_t discard_sample_buffer(size_t buffer_ptr);
+  void enqueue_samples(size_t buffer_ptr);
+  bool sample_buffer_available();
+  void wait_sample_buffer();
+  size_t get_pipeline_overruns();
+  // Telemetry since start(), safe to read while running.
+  const PipelineStats &get_stats() const;
+  // Also record each sub-band of the samples to its own file, from the
+  // next start().
+  void set_ddcs(const std::vector<DDCSpec> &specs);
+  void start(const std::string &file, const std::string &fft_file,
+             size_t max_samples_, size_t zlevel, bool useVkFFT_, size_t nfft_,
+             size_t nfft_overlap_, size_t nfft_div, size_t nfft_ds_,
+             size_t rate, size_t batches, size_t sample_id);
+  void stop(size_t overflows);
+  // Write the last seconds of samples received (at most the history set by
+  // set_sample_pipeline_history()) to file, prefixed with the time of the
+  // first sample, in the background. Returns the file name, or "" if there
+  // are no samples. Safe to call from any thread, while running or not.
+  std::string snapshot(double seconds, const std::string &file);
+  // Release sample and FFT buffers kept for the next start().
+  void free();
+
+private:
+  class Impl;
+  boost::scoped_ptr<Impl> impl_;
+};
+
+// Pipeline n (created on first use). The functions below use pipeline 0.
+SamplePipeline &get_sample_pipeline(size_t n);
+
 void set_sample_buffer_capacity(size_t buffer_ptr, size_t buffer_size);
 char *get_sample_buffer(size_t buffer_ptr, size_t *buffer_capacity);
-void enqueue_samples(size_t &buffer_ptr);
+// Returns a free sample buffer, or if none are free counts a pipeline overrun
+// and returns a discard buffer (whose samples enqueue_samples() drops).
+size_t acquire_sample_buffer();
+void enqueue_samples(size_t buffer_ptr);
+bool sample_buffer_available();
+void wait_sample_buffer();
+size_t get_pipeline_overruns();
 void sample_pipeline_start(const std::string &file, const std::string &fft_file,
                            size_t max_samples_, size_t zlevel, bool useVkFFT_,
                            size_t nfft_, size_t nfft_overlap_, size_t nfft_div,
@@ -11,5 +71,45 @@ void sample_pipeline_start(const std::string &file, const std::string &fft_file,
                            size_t sample_id);
 size_t get_samp_size();
 void sample_pipeline_stop(size_t overflows);
+// Sample and FFT buffers and vkFFT are kept initialized after
+// sample_pipeline_stop(), for the next sample_pipeline_start() with the same
+// parameters. Release them (for all pipelines).
+void sample_pipeline_free();
 void set_sample_pipeline_types(const std::string &type,
                                std::string &cpu_format);
+// Throws if FFT parameters are invalid (nfft 0 disables the FFT).
+void check_sample_pipeline_fft(size_t nfft, size_t nfft_overlap,
+                               size_t bin_decimation);
+void set_sample_pipeline_zthreads(size_t zthreads);
+void set_sample_pipeline_buffer_mb(size_t buffer_mb);
+void set_sample_pipeline_fft_threads(size_t fft_threads);
+void set_sample_pipeline_fftshift(bool fftshift);
+// mode is none, mean, max, min or ema, over frames FFT frames.
+void set_sample_pipeline_fft_avg(const std::string &mode, size_t frames);
+// encoding is float32, float16 or uint8 (over db_min to db_max). Each
+// bin_decimation bins are reduced to their mean, or max if bin_max is set.
+void set_sample_pipeline_fft_encoding(const std::string &encoding,
+                                      float db_min, float db_max,
+                                      size_t bin_decimation, bool bin_max);
+void set_sample_pipeline_fftw_wisdom(const std::string &wisdom_file);
+void set_sample_pipeline_vkfft_cache_dir(const std::string &cache_dir);
+void set_sample_pipeline_direct_io(bool direct_io);
+// Allocate sample and FFT buffers on NUMA node numa_node (-1 for any node).
+void set_sample_pipeline_numa_node(int numa_node);
+void set_sample_pipeline_prealloc_samples(size_t prealloc_samples);
+// Rotate output to a new file every seconds of samples or bytes of samples
+// (whichever is smaller, if both are set; 0 disables).
+void set_sample_pipeline_rotate(double seconds, size_t bytes);
+void set_sample_pipeline_ddcs(const std::vector<DDCSpec> &specs);
+// Keep the last seconds of samples received in memory, for
+// SamplePipeline::snapshot() (0 disables).
+void set_sample_pipeline_history(double seconds);
+// Write .zst output in the seekable format, in independently compressed
+// frames of frame_bytes, with a .idx index (0 writes a single frame).
+void set_sample_pipeline_seekable_frame_bytes(size_t frame_bytes);
+// Only write samples in bursts, each to its own file (named for the time of
+// its first sample): from pre_seconds before a sample buffer whose mean
+// power reaches dbfs, until hang_seconds after the last buffer that did.
+void set_sample_pipeline_trigger(bool trigger, double dbfs,
+                                 double pre_seconds, double hang_seconds);
+#endif
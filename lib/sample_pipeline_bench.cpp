@@ -0,0 +1,203 @@
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <complex>
+#include <iostream>
+
+#include "json.hpp"
+#include "sigpack/sigpack.h"
+
+#include "sample_writer.h"
+#include "specgram.h"
+
+using json = nlohmann::json;
+namespace po = boost::program_options;
+
+static double min_time = 0.2;
+static json results = json::array();
+
+// Run fn until at least min_time has elapsed, and record throughput over
+// samples_per_call samples per call.
+template <typename bench_fn>
+void bench(json result, size_t samples_per_call, bench_fn fn) {
+  fn();
+  size_t calls = 0;
+  const auto start = std::chrono::steady_clock::now();
+  double elapsed = 0;
+  do {
+    fn();
+    ++calls;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            start)
+                  .count();
+  } while (elapsed < min_time);
+  const double samples = double(calls) * samples_per_call;
+  result["msps"] = samples / elapsed / 1e6;
+  result["ns_per_sample"] = elapsed * 1e9 / samples;
+  std::cerr << result << std::endl;
+  results.push_back(result);
+}
+
+template <typename samp_type>
+void bench_type(const std::string &type, double full_scale, size_t rate,
+                const std::vector<size_t> &nffts,
+                const std::vector<size_t> &nfft_divs,
+                const std::vector<size_t> &zlevels,
+                const std::vector<size_t> &zthreads_list) {
+  arma::arma_rng::set_seed(0);
+  for (size_t nfft : nffts) {
+    arma::fvec window = interleave_window(
+        arma::conv_to<arma::fvec>::from(sp::hamming(nfft)));
+    for (size_t nfft_div : nfft_divs) {
+      const size_t samples = rate / nfft_div;
+      arma::fvec noise(samples * 2);
+      noise.randn();
+      std::vector<samp_type> buffer(samples);
+      for (size_t i = 0; i < samples; ++i) {
+        buffer[i] = samp_type(noise[i * 2] * full_scale * 0.01,
+                              noise[i * 2 + 1] * full_scale * 0.01);
+      }
+      for (size_t nfft_overlap : {size_t(0), nfft / 2}) {
+        arma::cx_fmat Pw_in;
+        json result;
+        result["stage"] = "specgram_window";
+        result["type"] = type;
+        result["nfft"] = nfft;
+        result["nfft_div"] = nfft_div;
+        result["nfft_overlap"] = nfft_overlap;
+        bench(result, samples, [&] {
+          specgram_window(buffer.data(), samples, Pw_in, window, nfft,
+                          nfft_overlap);
+        });
+      }
+    }
+  }
+
+  using namespace boost::filesystem;
+  path tmpdir = temp_directory_path() / unique_path();
+  create_directory(tmpdir);
+  const size_t samples = rate / nfft_divs.front();
+  arma::fvec noise(samples * 2);
+  noise.randn();
+  std::vector<samp_type> buffer(samples);
+  for (size_t i = 0; i < samples; ++i) {
+    buffer[i] = samp_type(noise[i * 2] * full_scale * 0.01,
+                          noise[i * 2 + 1] * full_scale * 0.01);
+  }
+  for (const std::string ext : {".dat", ".gz", ".zst"}) {
+    for (size_t zlevel : zlevels) {
+      for (size_t zthreads : zthreads_list) {
+        std::string file = tmpdir.string() + "/samples" + ext;
+        SampleWriter writer;
+        writer.open(file, zlevel, zthreads);
+        json result;
+        result["stage"] = "sample_writer";
+        result["type"] = type;
+        result["compression"] = ext;
+        result["zlevel"] = zlevel;
+        result["zthreads"] = zthreads;
+        bench(result, samples, [&writer, &buffer] {
+          writer.write((const char *)buffer.data(),
+                       buffer.size() * sizeof(samp_type));
+        });
+        writer.close(0);
+        remove(file);
+        if (ext != ".zst") {
+          break;
+        }
+      }
+      if (ext == ".dat") {
+        break;
+      }
+    }
+  }
+  remove_all(tmpdir);
+}
+
+void bench_fft(size_t rate, const std::vector<size_t> &nffts,
+               const std::vector<size_t> &nfft_divs) {
+  for (size_t nfft : nffts) {
+    arma::fvec window = arma::conv_to<arma::fvec>::from(sp::hamming(nfft));
+    const float window_sum = sum(window);
+    window = interleave_window(window);
+    for (size_t nfft_div : nfft_divs) {
+      const size_t samples = rate / nfft_div;
+      arma::cx_fvec samples_in(samples);
+      samples_in.randn();
+      for (size_t nfft_overlap : {size_t(0), nfft / 2}) {
+        arma::cx_fmat Pw_in, Pw;
+        arma::fmat fft_points_out;
+        specgram_window(samples_in.memptr(), samples, Pw_in, window, nfft,
+                        nfft_overlap);
+        Pw.copy_size(Pw_in);
+        json result;
+        result["nfft"] = nfft;
+        result["nfft_div"] = nfft_div;
+        result["nfft_overlap"] = nfft_overlap;
+        result["stage"] = "specgram_offload";
+        bench(result, samples, [&] { specgram_offload(Pw_in, Pw); });
+        result["stage"] = "fft_out_offload";
+        bench(result, samples,
+              [&] { specgram_power_db(Pw, window_sum, fft_points_out); });
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  size_t rate;
+  std::vector<size_t> nffts, nfft_divs, zlevels, zthreads_list;
+  std::vector<std::string> types;
+  po::options_description desc("Allowed options");
+  desc.add_options()("help", "help message")(
+      "rate", po::value<size_t>(&rate)->default_value(20480000),
+      "sample rate the nfft_div block sizes are derived from")(
+      "min_time", po::value<double>(&min_time)->default_value(min_time),
+      "minimum seconds to run each benchmark")(
+      "nfft",
+      po::value<std::vector<size_t>>(&nffts)->multitoken()->default_value(
+          {256, 1024, 2048, 4096}, "256 1024 2048 4096"),
+      "FFT point sizes")(
+      "nfft_div",
+      po::value<std::vector<size_t>>(&nfft_divs)->multitoken()->default_value(
+          {10, 50, 100}, "10 50 100"),
+      "FFT block divisors of rate")(
+      "zlevel",
+      po::value<std::vector<size_t>>(&zlevels)->multitoken()->default_value(
+          {1, 3, 9}, "1 3 9"),
+      "compression levels")(
+      "zthreads",
+      po::value<std::vector<size_t>>(&zthreads_list)
+          ->multitoken()
+          ->default_value({0, 4}, "0 4"),
+      "zstd compression threads")(
+      "type",
+      po::value<std::vector<std::string>>(&types)->multitoken()->default_value(
+          {"short", "float", "double"}, "short float double"),
+      "sample types");
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cerr << desc << std::endl;
+    return ~0;
+  }
+
+  for (const auto &type : types) {
+    if (type == "double") {
+      bench_type<std::complex<double>>(type, 1.0, rate, nffts, nfft_divs,
+                                       zlevels, zthreads_list);
+    } else if (type == "float") {
+      bench_type<std::complex<float>>(type, 1.0, rate, nffts, nfft_divs,
+                                      zlevels, zthreads_list);
+    } else if (type == "short") {
+      bench_type<std::complex<short>>(type, 32767.0, rate, nffts, nfft_divs,
+                                      zlevels, zthreads_list);
+    } else {
+      throw std::runtime_error("Unknown type " + type);
+    }
+  }
+  bench_fft(rate, nffts, nfft_divs);
+  std::cout << results << std::endl;
+  return 0;
+}
@@ -1,7 +1,15 @@
 #define BOOST_TEST_MAIN
 #include "sample_pipeline.h"
+#include "buffer_arena.h"
+#include "fft_encoding.h"
+#include "sample_source.h"
+#include "sample_writer.h"
+#include "specgram.h"
 #include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
+#include <fftw3.h>
+#include <fstream>
+#include <zstd.h>
 
 #include "sigpack/sigpack.h"
 
@@ -11,6 +19,38 @@ BOOST_AUTO_TEST_CASE(SmokeTest) {
   BOOST_TEST(cpu_format == "sc16");
   sample_pipeline_start("", "", 1e6, 1, false, 0, 0, 1, 1, 1e6, 0, 0);
   sample_pipeline_stop(0);
+  // restart with the buffers kept from the first start.
+  sample_pipeline_start("", "", 1e6, 1, false, 0, 0, 1, 1, 1e6, 0, 0);
+  sample_pipeline_stop(0);
+  // invalid FFT parameters are rejected before anything is started.
+  BOOST_CHECK_THROW(sample_pipeline_start("", "", 1e6, 1, false, 256, 256, 1,
+                                          1, 1e6, 0, 0),
+                    std::runtime_error);
+  set_sample_pipeline_fft_encoding("float32", 0, 0, 3, false);
+  BOOST_CHECK_THROW(sample_pipeline_start("", "", 1e6, 1, false, 256, 0, 1, 1,
+                                          1e6, 0, 0),
+                    std::runtime_error);
+  set_sample_pipeline_fft_encoding("float32", 0, 0, 1, false);
+  sample_pipeline_free();
+}
+
+BOOST_AUTO_TEST_CASE(BufferArenaTest) {
+  BufferArena arena;
+  arena.set_numa_node(0);
+  char *a = arena.alloc(100);
+  char *b = arena.alloc(kHugePageSize / 2);
+  char *c = arena.alloc(kHugePageSize);
+  BOOST_TEST((size_t(a) % kBufferArenaAlign) == 0);
+  BOOST_TEST((size_t(c) % kBufferArenaAlign) == 0);
+  // b fits after a, but c needs a new chunk.
+  BOOST_TEST(b == a + kBufferArenaAlign);
+  BOOST_TEST(arena.mapped() == 2 * kHugePageSize);
+  memset(a, 1, 100);
+  memset(c, 2, kHugePageSize);
+  BOOST_TEST(a[99] == 1);
+  BOOST_TEST(c[kHugePageSize - 1] == 2);
+  arena.release();
+  BOOST_TEST(arena.mapped() == 0);
 }
 
 BOOST_AUTO_TEST_CASE(RandomFFTTest) {
@@ -28,7 +68,7 @@ BOOST_AUTO_TEST_CASE(RandomFFTTest) {
   sample_pipeline_start(file, fft_file, samples.size(), 1, false, 256, 128, 1,
                         1, samples.size(), 100, 0);
   size_t buffer_capacity;
-  size_t write_ptr = 0;
+  size_t write_ptr = acquire_sample_buffer();
   char *buffer_p = get_sample_buffer(write_ptr, &buffer_capacity);
   memcpy(buffer_p, samples.memptr(),
          samples.size() * sizeof(std::complex<float>));
@@ -43,6 +83,13 @@ BOOST_AUTO_TEST_CASE(RandomFFTTest) {
   BOOST_TEST(samples_bytes == samples.size());
   BOOST_TEST(arma::all(samples == disk_samples));
   FILE *fft_samples_fp = fopen(fft_file.c_str(), "rb");
+  // skip the header.
+  char magic[kFFTHeaderMagicSize];
+  uint32_t header_len = 0;
+  BOOST_TEST(fread(magic, 1, sizeof(magic), fft_samples_fp) == sizeof(magic));
+  BOOST_TEST(!memcmp(magic, kFFTHeaderMagic, sizeof(magic)));
+  BOOST_TEST(fread(&header_len, sizeof(header_len), 1, fft_samples_fp) == 1);
+  fseek(fft_samples_fp, header_len, SEEK_CUR);
   arma::fvec fft(samples.size());
   int fft_bytes =
       fread(fft.memptr(), sizeof(float), fft.size(), fft_samples_fp);
@@ -52,3 +99,529 @@ BOOST_AUTO_TEST_CASE(RandomFFTTest) {
   fclose(fft_samples_fp);
   remove_all(tmpdir);
 }
+
+BOOST_AUTO_TEST_CASE(FFTThreadsTest) {
+  using namespace boost::filesystem;
+  path tmpdir = temp_directory_path() / unique_path();
+  create_directory(tmpdir);
+  const size_t buffers = 5, buffer_samples = 2e4;
+  arma::Col<std::complex<float>> samples(buffers * buffer_samples);
+  samples.randn();
+  std::string cpu_format;
+  set_sample_pipeline_types("float", cpu_format);
+  // FFT output is written in order, whichever worker transformed it.
+  const size_t fft_threads[] = {1, 4};
+  std::vector<char> fft_points[2];
+  for (size_t i = 0; i < 2; ++i) {
+    set_sample_pipeline_fft_threads(fft_threads[i]);
+    const std::string fft_file =
+        tmpdir.string() + "/fft_" + std::to_string(i) + ".dat";
+    sample_pipeline_start("", fft_file, buffer_samples, 1, false, 256, 128, 1,
+                          1, samples.size(), 10, 0);
+    for (size_t offset = 0; offset < samples.size();
+         offset += buffer_samples) {
+      size_t buffer_capacity;
+      size_t write_ptr = acquire_sample_buffer();
+      memcpy(get_sample_buffer(write_ptr, &buffer_capacity),
+             samples.memptr() + offset,
+             buffer_samples * sizeof(std::complex<float>));
+      enqueue_samples(write_ptr);
+    }
+    sample_pipeline_stop(0);
+    BOOST_TEST(get_pipeline_overruns() == 0);
+    fft_points[i].resize(file_size(fft_file));
+    std::ifstream in(fft_file, std::ios::binary);
+    in.read(fft_points[i].data(), fft_points[i].size());
+  }
+  set_sample_pipeline_fft_threads(1);
+  BOOST_TEST(fft_points[0].size() > 0);
+  BOOST_TEST((fft_points[0] == fft_points[1]));
+  remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(SyntheticSourceTest) {
+  using namespace boost::filesystem;
+  path tmpdir = temp_directory_path() / unique_path();
+  create_directory(tmpdir);
+  std::string file = tmpdir.string() + "/samples.dat";
+  std::string cpu_format;
+  set_sample_pipeline_types("short", cpu_format);
+  const size_t rate = 1e6;
+  const size_t max_samples = rate / 10;
+  const size_t nsamps = rate * 2;
+  bool stop_streaming = false;
+  sample_pipeline_start(file, "", max_samples, 1, false, 256, 0, 10, 1, rate,
+                        100, 0);
+  size_t samples = run_synthetic_source("short", {1e3, 2e5}, 0.01,
+                                        max_samples, rate, false, nsamps, 0,
+                                        stop_streaming);
+  sample_pipeline_stop(0);
+  BOOST_TEST(samples == nsamps);
+  BOOST_TEST(file_size(file) == nsamps * sizeof(std::complex<short>));
+  const PipelineStats &stats = get_sample_pipeline(0).get_stats();
+  BOOST_TEST(stats.samples.bytes_in == nsamps * sizeof(std::complex<short>));
+  BOOST_TEST(stats.samples.bytes_out == stats.samples.bytes_in);
+  BOOST_TEST(stats.write.count() == nsamps / max_samples);
+  BOOST_TEST(stats.fft.count() > 0);
+  BOOST_TEST(stats.sample_queue.value() == 0);
+  BOOST_TEST(stats.sample_queue.max() >= 1);
+  remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(MultiPipelineTest) {
+  using namespace boost::filesystem;
+  path tmpdir = temp_directory_path() / unique_path();
+  create_directory(tmpdir);
+  std::string cpu_format;
+  set_sample_pipeline_types("short", cpu_format);
+  const size_t samples = 1e5;
+  const size_t pipelines = 2;
+  for (size_t i = 0; i < pipelines; ++i) {
+    const std::string n = std::to_string(i);
+    get_sample_pipeline(i).start(tmpdir.string() + "/ch" + n + ".dat",
+                                 tmpdir.string() + "/fft_ch" + n + ".dat",
+                                 samples, 1, false, 256, 0, 10, 1, samples, 0,
+                                 0);
+  }
+  // each pipeline gets a different number of buffers of its channel number.
+  for (size_t i = 0; i < pipelines; ++i) {
+    SamplePipeline &pipeline = get_sample_pipeline(i);
+    for (size_t j = 0; j <= i; ++j) {
+      pipeline.wait_sample_buffer();
+      size_t write_ptr = pipeline.acquire_sample_buffer();
+      size_t buffer_capacity;
+      char *buffer_p = pipeline.get_sample_buffer(write_ptr, &buffer_capacity);
+      memset(buffer_p, int(i), buffer_capacity);
+      pipeline.enqueue_samples(write_ptr);
+    }
+  }
+  for (size_t i = 0; i < pipelines; ++i) {
+    get_sample_pipeline(i).stop(0);
+    const std::string file =
+        tmpdir.string() + "/ch" + std::to_string(i) + ".dat";
+    BOOST_TEST(file_size(file) ==
+               (i + 1) * samples * sizeof(std::complex<short>));
+    std::ifstream in(file, std::ios::binary);
+    BOOST_TEST(in.get() == int(i));
+    BOOST_TEST(get_sample_pipeline(i).get_pipeline_overruns() == 0);
+  }
+  sample_pipeline_free();
+  remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(TriggerTest) {
+  using namespace boost::filesystem;
+  path tmpdir = temp_directory_path() / unique_path();
+  create_directory(tmpdir);
+  std::string cpu_format;
+  set_sample_pipeline_types("short", cpu_format);
+  const size_t rate = 1e6;
+  const size_t max_samples = rate / 10;
+  // 2 buffers before, and 1 after.
+  set_sample_pipeline_trigger(true, -20, 0.2, 0.1);
+  sample_pipeline_start(tmpdir.string() + "/samples.dat", "", max_samples, 1,
+                        false, 0, 0, 10, 1, rate, 100, 0);
+  // a full scale / 2 (-6 dBFS) tone in buffers 5, 6 and 12.
+  for (size_t i = 0; i < 16; ++i) {
+    wait_sample_buffer();
+    size_t write_ptr = acquire_sample_buffer();
+    std::complex<short> *buffer_p =
+        (std::complex<short> *)get_sample_buffer(write_ptr, NULL);
+    const bool loud = i == 5 || i == 6 || i == 12;
+    std::fill(buffer_p, buffer_p + max_samples,
+              std::complex<short>(loud ? 16384 : 0, 0));
+    enqueue_samples(write_ptr);
+  }
+  sample_pipeline_stop(0);
+  set_sample_pipeline_trigger(false, 0, 0, 0);
+  std::vector<size_t> burst_buffers;
+  for (const auto &entry : directory_iterator(tmpdir)) {
+    burst_buffers.push_back(file_size(entry.path()) / max_samples /
+                            sizeof(std::complex<short>));
+  }
+  std::sort(burst_buffers.begin(), burst_buffers.end());
+  BOOST_TEST(burst_buffers == std::vector<size_t>({4, 5}),
+             boost::test_tools::per_element());
+  remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(SnapshotTest) {
+  using namespace boost::filesystem;
+  path tmpdir = temp_directory_path() / unique_path();
+  create_directory(tmpdir);
+  std::string cpu_format;
+  set_sample_pipeline_types("short", cpu_format);
+  const size_t rate = 1e6;
+  const size_t max_samples = rate / 10;
+  set_sample_pipeline_history(0.5);
+  // samples aren't written to a file, only kept in the history.
+  sample_pipeline_start("", "", max_samples, 1, false, 0, 0, 10, 1, rate, 100,
+                        0);
+  for (size_t i = 0; i < 10; ++i) {
+    wait_sample_buffer();
+    size_t write_ptr = acquire_sample_buffer();
+    size_t buffer_capacity;
+    char *buffer_p = get_sample_buffer(write_ptr, &buffer_capacity);
+    memset(buffer_p, int(i), buffer_capacity);
+    enqueue_samples(write_ptr);
+  }
+  sample_pipeline_stop(0);
+  SamplePipeline &pipeline = get_sample_pipeline(0);
+  BOOST_TEST(pipeline.snapshot(1, "").empty());
+  const std::string file =
+      pipeline.snapshot(0.3, tmpdir.string() + "/snapshot.dat");
+  BOOST_TEST(!file.empty());
+  // waits for the snapshot to be written.
+  sample_pipeline_free();
+  set_sample_pipeline_history(0);
+  BOOST_TEST(file_size(file) == 3 * max_samples * sizeof(std::complex<short>));
+  std::ifstream in(file, std::ios::binary);
+  BOOST_TEST(in.get() == 7);
+  remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(SeekableTest) {
+  using namespace boost::filesystem;
+  path tmpdir = temp_directory_path() / unique_path();
+  create_directory(tmpdir);
+  std::string file = tmpdir.string() + "/samples.zst";
+  std::string cpu_format;
+  set_sample_pipeline_types("short", cpu_format);
+  const size_t rate = 1e6;
+  const size_t max_samples = rate / 10;
+  bool stop_streaming = false;
+  set_sample_pipeline_seekable_frame_bytes(1 << 20);
+  sample_pipeline_start(file, "", max_samples, 1, false, 0, 0, 10, 1, rate,
+                        100, 0);
+  run_synthetic_source("short", {1e3}, 0.01, max_samples, rate, false, rate,
+                       0, stop_streaming);
+  sample_pipeline_stop(0);
+  set_sample_pipeline_seekable_frame_bytes(0);
+  std::ifstream index_in(file + ".idx");
+  const nlohmann::json index = nlohmann::json::parse(index_in);
+  BOOST_TEST(index["unit_bytes"].get<size_t>() == sizeof(std::complex<short>));
+  const nlohmann::json &frames = index["frames"];
+  BOOST_TEST(frames.size() == 4);
+  // a frame decompresses on its own, from its offset.
+  // offset, compressed offset, size, compressed size.
+  const auto frame = frames[2].get<std::vector<uint64_t>>();
+  BOOST_TEST(frame.at(0) == 2 << 20);
+  std::vector<char> compressed(frame.at(3));
+  std::ifstream in(file, std::ios::binary);
+  in.seekg(frame.at(1));
+  in.read(compressed.data(), compressed.size());
+  std::vector<char> samples(frame.at(2));
+  BOOST_TEST(ZSTD_decompress(samples.data(), samples.size(), compressed.data(),
+                             compressed.size()) == samples.size());
+  // a frame must hold at least one sample.
+  SeekableInfo seekable;
+  seekable.frame_bytes = 2;
+  seekable.unit_bytes = sizeof(std::complex<short>);
+  SampleWriter writer;
+  writer.set_seekable(seekable);
+  BOOST_CHECK_THROW(writer.open(tmpdir.string() + "/small.zst", 1),
+                    std::runtime_error);
+  remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(SpecgramFramesTest) {
+  const size_t nfft = 256, nfft_overlap = 192;
+  arma::cx_fvec samples(10000);
+  samples.randu();
+  arma::fvec window =
+      interleave_window(arma::conv_to<arma::fvec>::from(sp::hamming(nfft)));
+  arma::cx_fmat Pw_in;
+  specgram_window(samples.memptr(), samples.size(), Pw_in, window, nfft,
+                  nfft_overlap);
+  SpecgramFrames<std::complex<float>> frames;
+  frames.reset(nfft, nfft_overlap);
+  arma::cx_fmat Pw_stream(nfft, Pw_in.n_cols);
+  size_t frame = 0;
+  // buffers both shorter and longer than nfft.
+  for (arma::uword offset = 0, n = 100; offset < samples.size();
+       n = n * 3 % 997) {
+    n = std::min(n, samples.size() - offset);
+    frames.set_buffer(samples.memptr() + offset, n);
+    const std::complex<float> *frame_p;
+    while ((frame_p = frames.next())) {
+      BOOST_REQUIRE(frame < Pw_stream.n_cols);
+      window_samples(frame_p, Pw_stream.colptr(frame++), window.memptr(),
+                     nfft, 1);
+    }
+    offset += n;
+  }
+  BOOST_TEST(frame == Pw_in.n_cols);
+  BOOST_TEST(arma::approx_equal(Pw_in, Pw_stream, "absdiff", 1e-6));
+}
+
+BOOST_AUTO_TEST_CASE(FFTWTest) {
+  const size_t nfft = 1024, nfft_overlap = 512;
+  arma::cx_fvec samples(nfft * 16);
+  samples.randn();
+  arma::fvec window =
+      interleave_window(arma::conv_to<arma::fvec>::from(sp::hamming(nfft)));
+  arma::cx_fmat windowed;
+  specgram_window(samples.memptr(), samples.size(), windowed, window, nfft,
+                  nfft_overlap);
+  // FFTW aligned buffers, so the FFTW plan (rather than arma::fft) is used.
+  fftwf_complex *in_p = fftwf_alloc_complex(windowed.n_elem);
+  fftwf_complex *out_p = fftwf_alloc_complex(windowed.n_elem);
+  arma::cx_fmat Pw_in((std::complex<float> *)in_p, windowed.n_rows,
+                      windowed.n_cols, false, true);
+  arma::cx_fmat Pw((std::complex<float> *)out_p, windowed.n_rows,
+                   windowed.n_cols, false, true);
+  Pw_in = windowed;
+  specgram_offload(Pw_in, Pw);
+  for (arma::uword k = 0; k < windowed.n_cols; ++k) {
+    const arma::cx_fvec expected = arma::fft(windowed.col(k));
+    BOOST_TEST(arma::approx_equal(Pw.col(k), expected, "absdiff", 1e-2));
+  }
+  fftwf_free(in_p);
+  fftwf_free(out_p);
+  specgram_free_plans();
+}
+
+BOOST_AUTO_TEST_CASE(PowerDbTest) {
+  const size_t nfft = 255;
+  arma::cx_fmat Pw(nfft, 3);
+  Pw.randn();
+  const float window_sum = 100;
+  arma::fmat fft_points_out;
+  specgram_power_db(Pw, window_sum, fft_points_out, true);
+  arma::fmat expected =
+      arma::shift(log10(real(Pw % conj(Pw / window_sum))) * 10, nfft / 2);
+  BOOST_TEST(arma::approx_equal(fft_points_out, expected, "absdiff", 1e-3));
+}
+
+BOOST_AUTO_TEST_CASE(SpecgramAverageTest) {
+  const size_t nfft = 256, K = 4, D = 4, frames = 3 * K;
+  arma::cx_fmat Pw(nfft, frames);
+  Pw.randn();
+  const float window_sum = 100;
+  const arma::fmat power = arma::real(Pw % arma::conj(Pw)) / window_sum;
+  for (const std::string mode : {"mean", "max", "min", "ema"}) {
+    for (bool bin_max : {false, true}) {
+      SpecgramAverage average;
+      average.reset(mode, nfft, K, D, bin_max, window_sum, false);
+      // frames added across calls, not aligned to K.
+      std::vector<float> out, more_out;
+      average.add(Pw.cols(0, K + 1), out);
+      average.add(Pw.cols(K + 2, frames - 1), more_out);
+      out.insert(out.end(), more_out.begin(), more_out.end());
+      arma::fmat expected(nfft / D, frames / K);
+      arma::fvec ema = power.col(0);
+      for (size_t f = 0; f < frames / K; ++f) {
+        const arma::fmat block = power.cols(f * K, f * K + K - 1);
+        arma::fvec acc;
+        if (mode == "mean") {
+          acc = arma::mean(block, 1);
+        } else if (mode == "max") {
+          acc = arma::max(block, 1);
+        } else if (mode == "min") {
+          acc = arma::min(block, 1);
+        } else {
+          for (size_t k = f ? 0 : 1; k < K; ++k) {
+            ema += (block.col(k) - ema) / float(K);
+          }
+          acc = ema;
+        }
+        const arma::fmat bins = arma::reshape(acc, D, nfft / D);
+        const arma::frowvec decimated =
+            bin_max ? arma::frowvec(arma::max(bins, 0))
+                    : arma::frowvec(arma::mean(bins, 0));
+        expected.col(f) = arma::log10(decimated.t()) * 10;
+      }
+      BOOST_TEST(out.size() == expected.n_elem);
+      BOOST_TEST(arma::approx_equal(arma::fvec(out),
+                                    arma::vectorise(expected), "absdiff",
+                                    1e-3));
+    }
+  }
+  BOOST_CHECK_THROW(SpecgramAverage().reset("median", nfft, K, D, false,
+                                            window_sum, false),
+                    std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(FFTEncoderTest) {
+  const std::vector<float> points = {-150, -100, -50.2, 1, 0.5, 99.9, 150};
+  FFTEncoder encoder;
+  size_t bytes;
+  encoder.reset("uint8", -100, 100);
+  const uint8_t *u8_p =
+      (const uint8_t *)encoder.encode(points.data(), points.size(), &bytes);
+  BOOST_TEST(bytes == points.size());
+  const std::vector<uint8_t> u8(u8_p, u8_p + bytes);
+  BOOST_TEST(u8 == std::vector<uint8_t>({0, 0, 63, 129, 128, 255, 255}),
+             boost::test_tools::per_element());
+  encoder.reset("float16", 0, 0);
+  const uint16_t *f16_p =
+      (const uint16_t *)encoder.encode(points.data(), points.size(), &bytes);
+  BOOST_TEST(bytes == points.size() * sizeof(uint16_t));
+  // 1, 0.5 and 150 are exact in half precision.
+  BOOST_TEST(f16_p[3] == 0x3c00);
+  BOOST_TEST(f16_p[4] == 0x3800);
+  BOOST_TEST(f16_p[6] == 0x58b0);
+  BOOST_CHECK_THROW(encoder.reset("float8", 0, 0), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(DDCTest) {
+  const size_t rate = 1e6, n = 1e6;
+  const double freq = 2e5;
+  // a tone in the sub-band, and one outside it.
+  arma::cx_fvec samples(n);
+  for (size_t i = 0; i < n; ++i) {
+    samples[i] = std::polar(1.0f, float(2 * M_PI * (freq + 1e3) * i / rate)) +
+                 std::polar(1.0f, float(2 * M_PI * -3e5 * i / rate));
+  }
+  DDC ddc;
+  ddc.reset(rate, freq, 1e4);
+  BOOST_TEST(ddc.decimation() == 80);
+  BOOST_TEST(ddc.out_rate() == rate / 80);
+  // odd sized calls, so filter state must carry over.
+  std::vector<std::complex<float>> out;
+  for (size_t offset = 0, m = 0; offset < n; offset += m) {
+    m = std::min(size_t(33333), n - offset);
+    size_t bytes;
+    const std::complex<float> *out_p =
+        (const std::complex<float> *)ddc.process(samples.memptr() + offset, m,
+                                                 &bytes);
+    out.insert(out.end(), out_p, out_p + bytes / sizeof(*out_p));
+  }
+  BOOST_TEST(out.size() == n / 80);
+  // after the filter delay, only the 1kHz tone (power 1) remains.
+  double power = 0;
+  for (size_t i = out.size() / 2; i < out.size(); ++i) {
+    power += std::norm(out[i]);
+  }
+  power /= out.size() - out.size() / 2;
+  BOOST_TEST(std::fabs(power - 1) < 0.05);
+  BOOST_CHECK_THROW(ddc.reset(rate, 4.99e5, 1e4), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(RotateTest) {
+  using namespace boost::filesystem;
+  path tmpdir = temp_directory_path() / unique_path();
+  create_directory(tmpdir);
+  std::string file = tmpdir.string() + "/samples.dat";
+  std::string cpu_format;
+  set_sample_pipeline_types("short", cpu_format);
+  const size_t rate = 1e6;
+  // rotate mid-buffer, so boundaries must be sample exact.
+  const size_t max_samples = rate / 3;
+  const size_t nsamps = rate * 2;
+  bool stop_streaming = false;
+  set_sample_pipeline_rotate(0.5, 0);
+  sample_pipeline_start(file, "", max_samples, 1, false, 0, 0, 10, 1, rate,
+                        100, 0);
+  run_synthetic_source("short", {1e3}, 0.01, max_samples, rate, false, nsamps,
+                       0, stop_streaming);
+  sample_pipeline_stop(0);
+  set_sample_pipeline_rotate(0, 0);
+  size_t files = 0;
+  for (const auto &entry : directory_iterator(tmpdir)) {
+    ++files;
+    BOOST_TEST(file_size(entry.path()) ==
+               rate / 2 * sizeof(std::complex<short>));
+  }
+  BOOST_TEST(files == 4);
+  remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(OverrunTest) {
+  using namespace boost::filesystem;
+  path tmpdir = temp_directory_path() / unique_path();
+  create_directory(tmpdir);
+  std::string file = tmpdir.string() + "/samples.dat";
+  std::string cpu_format;
+  set_sample_pipeline_types("short", cpu_format);
+  const size_t max_samples = 1e4;
+  for (size_t overflows = 0; overflows < 2; ++overflows) {
+    sample_pipeline_start(file, "", max_samples, 1, false, 0, 0, 1, 1, 1e6, 0,
+                          0);
+    // hold every buffer, so the next acquire overruns.
+    std::vector<size_t> write_ptrs;
+    for (;;) {
+      const size_t write_ptr = acquire_sample_buffer();
+      if (get_pipeline_overruns()) {
+        enqueue_samples(write_ptr);
+        break;
+      }
+      write_ptrs.push_back(write_ptr);
+    }
+    for (size_t write_ptr : write_ptrs) {
+      size_t buffer_capacity;
+      memset(get_sample_buffer(write_ptr, &buffer_capacity), 0,
+             buffer_capacity);
+      enqueue_samples(write_ptr);
+    }
+    sample_pipeline_stop(overflows);
+    BOOST_TEST(get_pipeline_overruns() == 1);
+    // UHD overflows take precedence over overruns in the file name.
+    const std::string prefix = overflows ? "overflow-" : "overrun-";
+    BOOST_TEST(exists(tmpdir / (prefix + "samples.dat")));
+    BOOST_TEST(!exists(file));
+    BOOST_TEST(file_size(tmpdir / (prefix + "samples.dat")) ==
+               write_ptrs.size() * max_samples * sizeof(std::complex<short>));
+    remove(tmpdir / (prefix + "samples.dat"));
+  }
+  remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(DirectWriterTest) {
+  using namespace boost::filesystem;
+  path tmpdir = temp_directory_path() / unique_path();
+  create_directory(tmpdir);
+  std::string file = tmpdir.string() + "/samples.dat";
+  const size_t len = 3 * 1024 * 1024 + 123;
+  const size_t aligned = 1024 * 1024;
+  char *data = (char *)aligned_alloc(4096, len + 4096 - len % 4096);
+  for (size_t i = 0; i < len; ++i) {
+    data[i] = char(i * 7 + i / 4096);
+  }
+  SampleWriter writer;
+  writer.open(file, 0, 0, true, len * 2);
+  // an aligned write, then unaligned ones, leaving a tail to flush on close.
+  writer.write(data, aligned);
+  for (size_t offset = aligned; offset < len; offset += 1000) {
+    writer.write(data + offset, std::min(size_t(1000), len - offset));
+  }
+  writer.close(0);
+  BOOST_TEST(file_size(file) == len);
+  std::vector<char> disk_data(len);
+  std::ifstream in(file, std::ios::binary);
+  in.read(disk_data.data(), len);
+  BOOST_TEST(size_t(in.gcount()) == len);
+  BOOST_TEST(memcmp(disk_data.data(), data, len) == 0);
+  free(data);
+  remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(ZstdThreadsTest) {
+  using namespace boost::filesystem;
+  path tmpdir = temp_directory_path() / unique_path();
+  create_directory(tmpdir);
+  std::string file = tmpdir.string() + "/samples.zst";
+  // enough for several jobs per worker.
+  std::vector<char> data(32 * 1024 * 1024);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = char((i * i) >> 12);
+  }
+  SampleWriter writer;
+  writer.open(file, 1, 3);
+  for (size_t offset = 0; offset < data.size(); offset += 100000) {
+    writer.write(data.data() + offset,
+                 std::min(size_t(100000), data.size() - offset));
+  }
+  writer.close(0);
+  std::vector<char> compressed(file_size(file));
+  std::ifstream in(file, std::ios::binary);
+  in.read(compressed.data(), compressed.size());
+  BOOST_TEST(compressed.size() < data.size());
+  std::vector<char> decompressed(data.size() + 1);
+  BOOST_TEST(ZSTD_decompress(decompressed.data(), decompressed.size(),
+                             compressed.data(),
+                             compressed.size()) == data.size());
+  decompressed.resize(data.size());
+  BOOST_TEST((decompressed == data));
+  remove_all(tmpdir);
+}
@@ -0,0 +1,43 @@
+#include "sample_ring.h"
+#include <cstring>
+
+void SampleRing::reset(size_t capacity, int numa_node) {
+  if (capacity != capacity_ || numa_node != arena_.numa_node()) {
+    arena_.release();
+    arena_.set_numa_node(numa_node);
+    p_ = capacity ? arena_.alloc(capacity, capacity) : NULL;
+    capacity_ = capacity;
+  }
+  begin_ = 0;
+  end_ = 0;
+  writing_ = 0;
+}
+
+void SampleRing::push(const char *p, size_t len) {
+  if (!capacity_) {
+    return;
+  }
+  const uint64_t end_offset = end_.load(std::memory_order_relaxed);
+  writing_.store(end_offset + len, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  // only the last capacity_ bytes are kept.
+  const size_t skip = len > capacity_ ? len - capacity_ : 0;
+  const size_t pos = (end_offset + skip) % capacity_;
+  const size_t first = std::min(len - skip, capacity_ - pos);
+  memcpy(p_ + pos, p + skip, first);
+  memcpy(p_, p + skip + first, len - skip - first);
+  end_.store(end_offset + len, std::memory_order_release);
+}
+
+bool SampleRing::copy(uint64_t offset, size_t len, char *out_p) const {
+  if (offset < begin() || offset + len > end()) {
+    return false;
+  }
+  const size_t pos = offset % capacity_;
+  const size_t first = std::min(len, capacity_ - pos);
+  memcpy(out_p, p_ + pos, first);
+  memcpy(out_p + first, p_, len - first);
+  // a push that started during the copy may have overwritten it.
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return writing_.load(std::memory_order_relaxed) <= offset + capacity_;
+}
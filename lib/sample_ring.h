@@ -0,0 +1,55 @@
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "buffer_arena.h"
+
+#ifndef SAMPLE_RING_H
+#define SAMPLE_RING_H 1
+// The most recent capacity bytes of samples, in a BufferArena (so pushing
+// never page faults), oldest overwritten first. Bytes are addressed by
+// their offset in the stream of bytes pushed. One thread pushes, and others
+// may copy() out concurrently.
+class SampleRing {
+public:
+  SampleRing() : p_(NULL), capacity_(0), begin_(0), end_(0), writing_(0) {}
+  // Empties the ring, only reallocating if capacity or numa_node changed.
+  void reset(size_t capacity, int numa_node);
+  void clear() { begin_ = end(); }
+  void push(const char *p, size_t len);
+  // Offsets of the oldest byte held, and after the newest.
+  uint64_t begin() const {
+    const uint64_t end_offset = end();
+    return std::max(begin_, end_offset - std::min(end_offset,
+                                                  uint64_t(capacity_)));
+  }
+  uint64_t end() const { return end_.load(std::memory_order_acquire); }
+  size_t size() const { return end() - begin(); }
+  size_t capacity() const { return capacity_; }
+  // Copies len bytes from offset to out_p. Returns false if they weren't
+  // all held, or were overwritten by a push while being copied.
+  bool copy(uint64_t offset, size_t len, char *out_p) const;
+  // Calls write(p, len) with the contents, oldest first (from the pushing
+  // thread).
+  template <typename F> void read(F write) const {
+    const uint64_t end_offset = end();
+    for (uint64_t offset = begin(); offset < end_offset;) {
+      const size_t pos = offset % capacity_;
+      const size_t len = std::min(end_offset - offset,
+                                  uint64_t(capacity_ - pos));
+      write(p_ + pos, len);
+      offset += len;
+    }
+  }
+
+private:
+  BufferArena arena_;
+  char *p_;
+  size_t capacity_;
+  // begin_ is only set by clear(). writing_ is end_ after the push in
+  // progress (so bytes before writing_ - capacity_ may be overwritten).
+  uint64_t begin_;
+  std::atomic<uint64_t> end_, writing_;
+};
+#endif
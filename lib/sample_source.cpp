@@ -0,0 +1,137 @@
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filter/zstd.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <chrono>
+#include <complex>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <thread>
+
+#include "sample_pipeline.h"
+#include "sample_source.h"
+
+template <typename fill_fn>
+size_t run_source(fill_fn fill, size_t max_samples, size_t rate, bool paced,
+                  size_t num_requested_samples, double time_requested,
+                  const bool &stop_streaming) {
+  const size_t samp_size = get_samp_size();
+  size_t num_total_samps = 0;
+  const auto start_time = std::chrono::steady_clock::now();
+  const auto stop_time =
+      start_time + std::chrono::milliseconds(int64_t(1000 * time_requested));
+
+  while (!stop_streaming) {
+    if (num_requested_samples && num_total_samps >= num_requested_samples)
+      break;
+    if (time_requested && std::chrono::steady_clock::now() >= stop_time)
+      break;
+    wait_sample_buffer();
+
+    size_t write_ptr = acquire_sample_buffer();
+    size_t buffer_capacity = 0;
+    char *buffer_p = get_sample_buffer(write_ptr, &buffer_capacity);
+    size_t samples = max_samples;
+    if (num_requested_samples) {
+      samples = std::min(samples, num_requested_samples - num_total_samps);
+    }
+    samples = fill(buffer_p, samples);
+    size_t samp_bytes = samples * samp_size;
+    if (samp_bytes != buffer_capacity) {
+      set_sample_buffer_capacity(write_ptr, samp_bytes);
+    }
+    // always enqueue, so the writer returns the buffer to the pool.
+    enqueue_samples(write_ptr);
+    if (!samples)
+      break;
+    num_total_samps += samples;
+
+    if (paced) {
+      std::this_thread::sleep_until(
+          start_time + std::chrono::nanoseconds(int64_t(
+                           num_total_samps * (1e9 / double(rate)))));
+    }
+  }
+
+  return num_total_samps;
+}
+
+size_t run_file_source(const std::string &file, size_t max_samples,
+                       size_t rate, bool paced, size_t num_requested_samples,
+                       double time_requested, const bool &stop_streaming) {
+  boost::filesystem::path path(file);
+  boost::iostreams::filtering_istream inbuf;
+  if (path.extension() == ".gz") {
+    inbuf.push(boost::iostreams::gzip_decompressor());
+  } else if (path.extension() == ".zst") {
+    inbuf.push(boost::iostreams::zstd_decompressor());
+  }
+  inbuf.push(boost::iostreams::file_source(file));
+  std::cerr << "replaying samples from " << file << std::endl;
+  const size_t samp_size = get_samp_size();
+
+  return run_source(
+      [&inbuf, samp_size](char *buffer_p, size_t samples) -> size_t {
+        inbuf.read(buffer_p, samples * samp_size);
+        return inbuf.gcount() / samp_size;
+      },
+      max_samples, rate, paced, num_requested_samples, time_requested,
+      stop_streaming);
+}
+
+template <typename samp_type>
+void fill_synthetic_samples(char *pattern_p, const std::vector<double> &tones,
+                            double noise, double full_scale, size_t samples,
+                            size_t rate) {
+  // Round tones to whole cycles per pattern so repeating the pattern keeps
+  // them phase continuous across buffers.
+  std::vector<double> tone_cycles;
+  for (double tone : tones) {
+    tone_cycles.push_back(round(tone * samples / double(rate)));
+  }
+  const double amplitude = tones.size() ? 0.5 / tones.size() : 0;
+  std::mt19937 gen(0);
+  std::normal_distribution<double> dist;
+  samp_type *samples_p = (samp_type *)pattern_p;
+  for (size_t i = 0; i < samples; ++i) {
+    std::complex<double> sample(noise * dist(gen), noise * dist(gen));
+    for (double cycles : tone_cycles) {
+      sample += std::polar(amplitude, 2 * M_PI * cycles * i / double(samples));
+    }
+    sample *= full_scale;
+    samples_p[i] = samp_type(sample.real(), sample.imag());
+  }
+}
+
+size_t run_synthetic_source(const std::string &type,
+                            const std::vector<double> &tones, double noise,
+                            size_t max_samples, size_t rate, bool paced,
+                            size_t num_requested_samples, double time_requested,
+                            const bool &stop_streaming) {
+  const size_t samp_size = get_samp_size();
+  std::vector<char> pattern(max_samples * samp_size);
+  if (type == "double") {
+    fill_synthetic_samples<std::complex<double>>(pattern.data(), tones, noise,
+                                                 1.0, max_samples, rate);
+  } else if (type == "float") {
+    fill_synthetic_samples<std::complex<float>>(pattern.data(), tones, noise,
+                                                1.0, max_samples, rate);
+  } else if (type == "short") {
+    fill_synthetic_samples<std::complex<short>>(pattern.data(), tones, noise,
+                                                32767.0, max_samples, rate);
+  } else {
+    throw std::runtime_error("Unknown type " + type);
+  }
+  std::cerr << "generating " << tones.size() << " synthetic tones"
+            << std::endl;
+
+  return run_source(
+      [&pattern, samp_size](char *buffer_p, size_t samples) -> size_t {
+        memcpy(buffer_p, pattern.data(), samples * samp_size);
+        return samples;
+      },
+      max_samples, rate, paced, num_requested_samples, time_requested,
+      stop_streaming);
+}
@@ -0,0 +1,20 @@
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#ifndef SAMPLE_SOURCE_H
+#define SAMPLE_SOURCE_H 1
+// Hardware-free sample producers for the sample pipeline. Each runs until
+// num_requested_samples/time_requested are reached (if non-zero), the input
+// is exhausted or stop_streaming is set, and returns the number of samples
+// enqueued. If paced is false, samples are enqueued as fast as the pipeline
+// accepts them, otherwise at rate samples per second.
+size_t run_file_source(const std::string &file, size_t max_samples,
+                       size_t rate, bool paced, size_t num_requested_samples,
+                       double time_requested, const bool &stop_streaming);
+size_t run_synthetic_source(const std::string &type,
+                            const std::vector<double> &tones, double noise,
+                            size_t max_samples, size_t rate, bool paced,
+                            size_t num_requested_samples, double time_requested,
+                            const bool &stop_streaming);
+#endif
@@ -1,8 +1,346 @@
 #include "sample_writer.h"
 #include <boost/filesystem.hpp>
+#include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/iostreams/filter/zstd.hpp>
+#include <boost/iostreams/operations.hpp>
+#include <boost/shared_ptr.hpp>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <unistd.h>
+#include <vector>
+#include <zstd.h>
+
+#include "json.hpp"
+
+const std::streamsize kZstdMtBufferSize = 1 << 20;
+const size_t kDirectBufferSize = 4 << 20;
+// zstd seekable format (contrib/seekable_format in the zstd repo).
+const uint32_t kZstdSkippableMagic = 0x184D2A5E;
+const uint32_t kZstdSeekableMagic = 0x8F92EAB1;
+
+// zstd compressor using libzstd directly, so that compression can be
+// spread over zthreads worker threads (boost's zstd_compressor is single
+// threaded).
+class zstd_mt_compressor : public boost::iostreams::multichar_output_filter {
+public:
+  zstd_mt_compressor(size_t zlevel, size_t zthreads)
+      : cctx_(ZSTD_createCCtx(), ZSTD_freeCCtx), out_(ZSTD_CStreamOutSize()) {
+    ZSTD_CCtx_setParameter(cctx_.get(), ZSTD_c_compressionLevel, zlevel);
+    size_t res =
+        ZSTD_CCtx_setParameter(cctx_.get(), ZSTD_c_nbWorkers, zthreads);
+    if (ZSTD_isError(res)) {
+      throw std::runtime_error(std::string("zstd threads unavailable: ") +
+                               ZSTD_getErrorName(res));
+    }
+  }
+
+  template <typename Sink>
+  std::streamsize write(Sink &snk, const char *s, std::streamsize n) {
+    ZSTD_inBuffer in = {s, size_t(n), 0};
+    while (in.pos < in.size) {
+      const size_t in_pos = in.pos;
+      size_t out_bytes;
+      compress(snk, in, ZSTD_e_continue, out_bytes);
+      if (in.pos == in_pos && !out_bytes) {
+        // all workers busy, so flush (which blocks until they have output).
+        while (compress(snk, in, ZSTD_e_flush, out_bytes)) {
+        }
+      }
+    }
+    return n;
+  }
+
+  template <typename Sink> void close(Sink &snk) {
+    ZSTD_inBuffer in = {NULL, 0, 0};
+    size_t out_bytes;
+    // blocks until each call's output is ready.
+    while (compress(snk, in, ZSTD_e_end, out_bytes)) {
+    }
+  }
+
+private:
+  // Returns the bytes left to flush, and sets out_bytes to those written.
+  template <typename Sink>
+  size_t compress(Sink &snk, ZSTD_inBuffer &in, ZSTD_EndDirective mode,
+                  size_t &out_bytes) {
+    ZSTD_outBuffer out = {out_.data(), out_.size(), 0};
+    const size_t remaining = ZSTD_compressStream2(cctx_.get(), &out, &in, mode);
+    if (ZSTD_isError(remaining)) {
+      throw std::runtime_error(ZSTD_getErrorName(remaining));
+    }
+    boost::iostreams::write(snk, out_.data(), out.pos);
+    out_bytes = out.pos;
+    return remaining;
+  }
+
+  boost::shared_ptr<ZSTD_CCtx> cctx_;
+  std::vector<char> out_;
+};
+
+// zstd compressor writing the seekable format: independent frames of
+// frame_bytes, then a seek table in a skippable frame (so the file is still
+// an ordinary zstd stream). Up to zthreads frames are compressed in
+// parallel (each in its own thread), and written in order.
+class zstd_seekable_compressor
+    : public boost::iostreams::multichar_output_filter {
+public:
+  zstd_seekable_compressor(
+      size_t zlevel, size_t zthreads, size_t frame_bytes,
+      boost::shared_ptr<std::vector<SeekableFrame>> frames)
+      : state_(new State()) {
+    state_->frame_bytes = frame_bytes;
+    state_->jobs_max = std::max(zthreads, size_t(1));
+    state_->parallel = zthreads > 0;
+    state_->frames = frames;
+    state_->offset = 0;
+    state_->compressed_offset = 0;
+    for (size_t i = 0; i < state_->jobs_max; ++i) {
+      state_->cctxs.push_back(
+          boost::shared_ptr<ZSTD_CCtx>(ZSTD_createCCtx(), ZSTD_freeCCtx));
+      ZSTD_CCtx_setParameter(state_->cctxs.back().get(),
+                             ZSTD_c_compressionLevel, zlevel);
+    }
+    state_->next_cctx = 0;
+    state_->in.reserve(frame_bytes);
+  }
+
+  template <typename Sink>
+  std::streamsize write(Sink &snk, const char *s, std::streamsize n) {
+    State &state = *state_;
+    for (std::streamsize i = 0; i < n;) {
+      const size_t len =
+          std::min(size_t(n - i), state.frame_bytes - state.in.size());
+      state.in.insert(state.in.end(), s + i, s + i + len);
+      i += len;
+      if (state.in.size() == state.frame_bytes) {
+        compress_frame(snk);
+      }
+    }
+    return n;
+  }
+
+  template <typename Sink> void close(Sink &snk) {
+    State &state = *state_;
+    if (!state.in.empty()) {
+      compress_frame(snk);
+    }
+    while (!state.jobs.empty()) {
+      write_frame(snk);
+    }
+    write_seek_table(snk);
+  }
+
+private:
+  struct Job {
+    std::future<std::vector<char>> compressed;
+    uint32_t size;
+  };
+
+  struct State {
+    size_t frame_bytes, jobs_max, next_cctx;
+    bool parallel;
+    std::vector<char> in;
+    // a job uses the cctx of the job jobs_max before it, which is done.
+    std::vector<boost::shared_ptr<ZSTD_CCtx>> cctxs;
+    std::deque<Job> jobs;
+    uint64_t offset, compressed_offset;
+    boost::shared_ptr<std::vector<SeekableFrame>> frames;
+  };
+
+  static std::vector<char> compress(ZSTD_CCtx *cctx,
+                                    const std::vector<char> &in) {
+    std::vector<char> out(ZSTD_compressBound(in.size()));
+    const size_t len =
+        ZSTD_compress2(cctx, out.data(), out.size(), in.data(), in.size());
+    if (ZSTD_isError(len)) {
+      throw std::runtime_error(ZSTD_getErrorName(len));
+    }
+    out.resize(len);
+    return out;
+  }
+
+  template <typename Sink> void compress_frame(Sink &snk) {
+    State &state = *state_;
+    if (state.jobs.size() == state.jobs_max) {
+      write_frame(snk);
+    }
+    Job job;
+    job.size = state.in.size();
+    boost::shared_ptr<ZSTD_CCtx> cctx = state.cctxs[state.next_cctx];
+    state.next_cctx = (state.next_cctx + 1) % state.jobs_max;
+    job.compressed = std::async(
+        state.parallel ? std::launch::async : std::launch::deferred,
+        [cctx](const std::vector<char> &in) {
+          return compress(cctx.get(), in);
+        },
+        std::move(state.in));
+    state.jobs.push_back(std::move(job));
+    state.in.clear();
+    state.in.reserve(state.frame_bytes);
+  }
+
+  template <typename Sink> void write_frame(Sink &snk) {
+    State &state = *state_;
+    Job &job = state.jobs.front();
+    const std::vector<char> compressed = job.compressed.get();
+    boost::iostreams::write(snk, compressed.data(), compressed.size());
+    SeekableFrame frame;
+    frame.offset = state.offset;
+    frame.compressed_offset = state.compressed_offset;
+    frame.size = job.size;
+    frame.compressed_size = compressed.size();
+    state.frames->push_back(frame);
+    state.offset += frame.size;
+    state.compressed_offset += frame.compressed_size;
+    state.jobs.pop_front();
+  }
+
+  template <typename Sink> void write_seek_table(Sink &snk) {
+    const std::vector<SeekableFrame> &frames = *state_->frames;
+    std::vector<uint32_t> table;
+    table.push_back(kZstdSkippableMagic);
+    // entries, then number of frames, a descriptor byte and the magic.
+    table.push_back(frames.size() * 8 + 9);
+    for (const auto &frame : frames) {
+      table.push_back(frame.compressed_size);
+      table.push_back(frame.size);
+    }
+    table.push_back(frames.size());
+    // assumes a little endian host, as the sample formats do.
+    boost::iostreams::write(snk, (const char *)table.data(),
+                            table.size() * sizeof(uint32_t));
+    const char descriptor = 0;
+    boost::iostreams::write(snk, &descriptor, 1);
+    boost::iostreams::write(snk, (const char *)&kZstdSeekableMagic,
+                            sizeof(kZstdSeekableMagic));
+  }
+
+  boost::shared_ptr<State> state_;
+};
+
+// Counts bytes passed through to the file (after compression).
+class byte_counter : public boost::iostreams::multichar_output_filter {
+public:
+  explicit byte_counter(WriterStats *stats) : stats_(stats) {}
+
+  template <typename Sink>
+  std::streamsize write(Sink &snk, const char *s, std::streamsize n) {
+    stats_->bytes_out.fetch_add(n, std::memory_order_relaxed);
+    return boost::iostreams::write(snk, s, n);
+  }
+
+private:
+  WriterStats *stats_;
+};
+
+// Uncompressed writer using O_DIRECT. Aligned writes are passed straight to
+// the file; unaligned data is staged in an aligned bounce buffer.
+class DirectWriter {
+public:
+  explicit DirectWriter(const std::string &file) : pending_(0) {
+    fd_ = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd_ < 0) {
+      std::cerr << "O_DIRECT unavailable for " << file << ": "
+                << strerror(errno) << std::endl;
+      fd_ = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd_ < 0) {
+      throw std::runtime_error("cannot open " + file + ": " + strerror(errno));
+    }
+    buf_ = (char *)aligned_alloc(kDirectIOAlign, kDirectBufferSize);
+  }
+
+  // close() writes any buffered tail, which the destructor doesn't.
+  ~DirectWriter() noexcept {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+    free(buf_);
+  }
+
+  int fd() const { return fd_; }
+
+  void close() {
+    flush();
+    if (::close(fd_)) {
+      fd_ = -1;
+      throw std::runtime_error(std::string("close failed: ") +
+                               strerror(errno));
+    }
+    fd_ = -1;
+  }
+
+  void write(const char *data, size_t len) {
+    if (pending_) {
+      buffer(data, len);
+      if (!len) {
+        return;
+      }
+    }
+    if ((uintptr_t)data % kDirectIOAlign == 0) {
+      const size_t direct_len = len - (len % kDirectIOAlign);
+      write_all(data, direct_len);
+      data += direct_len;
+      len -= direct_len;
+    }
+    while (len) {
+      buffer(data, len);
+    }
+  }
+
+private:
+  void buffer(const char *&data, size_t &len) {
+    const size_t n = std::min(len, kDirectBufferSize - pending_);
+    memcpy(buf_ + pending_, data, n);
+    pending_ += n;
+    data += n;
+    len -= n;
+    if (pending_ == kDirectBufferSize) {
+      write_all(buf_, pending_);
+      pending_ = 0;
+    }
+  }
+
+  void flush() {
+    if (pending_) {
+      // O_DIRECT requires aligned lengths, so write the tail without it.
+      fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+      write_all(buf_, pending_);
+      pending_ = 0;
+    }
+  }
+
+  void write_all(const char *data, size_t len) {
+    while (len) {
+      ssize_t written = ::write(fd_, data, len);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error(std::string("write failed: ") +
+                                 strerror(errno));
+      }
+      data += written;
+      len -= written;
+    }
+  }
+
+  int fd_;
+  char *buf_;
+  size_t pending_;
+};
+
+void preallocate(int fd, size_t prealloc_bytes) {
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, prealloc_bytes)) {
+    std::cerr << "cannot preallocate " << prealloc_bytes
+              << " bytes: " << strerror(errno) << std::endl;
+  }
+}
 
 std::string get_prefix_file(const std::string &file,
                             const std::string &prefix) {
@@ -17,49 +355,145 @@ std::string get_dotfile(const std::string &file) {
   return get_prefix_file(file, ".");
 }
 
-SampleWriter::SampleWriter() {
+SampleWriter::SampleWriter() : prealloc_bytes_(0), stats_(NULL) {
   outbuf_p.reset(new boost::iostreams::filtering_ostream());
 }
 
+SampleWriter::~SampleWriter() {}
+
 void SampleWriter::write(const char *data, size_t len) {
-  if (!outbuf_p->empty()) {
+  if (direct_p) {
+    direct_p->write(data, len);
+    if (stats_) {
+      stats_->bytes_out.fetch_add(len, std::memory_order_relaxed);
+    }
+  } else if (!outbuf_p->empty()) {
     outbuf_p->write(data, len);
+  } else {
+    return;
+  }
+  if (stats_) {
+    stats_->bytes_in.fetch_add(len, std::memory_order_relaxed);
   }
 }
 
-void SampleWriter::open(const std::string &file, size_t zlevel) {
+void SampleWriter::open(const std::string &file, size_t zlevel,
+                        size_t zthreads, bool direct_io,
+                        size_t prealloc_bytes, WriterStats *stats) {
   file_ = file;
+  stats_ = stats;
   dotfile_ = get_dotfile(file_);
   orig_path_ = boost::filesystem::path(file_);
   std::cerr << "opening " << dotfile_ << std::endl;
+  const bool compressed = orig_path_.extension() == ".gz" ||
+                          orig_path_.extension() == ".zst";
+  // compressed size isn't known, so only uncompressed output is
+  // preallocated.
+  prealloc_bytes_ = compressed ? 0 : prealloc_bytes;
+  if (direct_io && !compressed) {
+    std::cerr << "writing uncompressed output with direct I/O" << std::endl;
+    direct_p.reset(new DirectWriter(dotfile_));
+    if (prealloc_bytes_) {
+      preallocate(direct_p->fd(), prealloc_bytes_);
+    }
+    return;
+  }
   if (orig_path_.has_extension()) {
     if (orig_path_.extension() == ".gz") {
       std::cerr << "writing gzip compressed output" << std::endl;
       outbuf_p->push(boost::iostreams::gzip_compressor(
           boost::iostreams::gzip_params(zlevel)));
     } else if (orig_path_.extension() == ".zst") {
-      std::cerr << "writing zstd compressed output" << std::endl;
-      outbuf_p->push(boost::iostreams::zstd_compressor(
-          boost::iostreams::zstd_params(zlevel)));
+      if (seekable_.frame_bytes &&
+          seekable_.frame_bytes < seekable_.unit_bytes) {
+        throw std::runtime_error("seekable frame of " +
+                                 std::to_string(seekable_.frame_bytes) +
+                                 " bytes is smaller than a unit of " +
+                                 std::to_string(seekable_.unit_bytes));
+      }
+      const size_t frame_bytes =
+          seekable_.frame_bytes / seekable_.unit_bytes * seekable_.unit_bytes;
+      if (frame_bytes) {
+        std::cerr << "writing seekable zstd compressed output in frames of "
+                  << frame_bytes << " bytes" << std::endl;
+        seekable_frames_.reset(new std::vector<SeekableFrame>());
+        outbuf_p->push(zstd_seekable_compressor(zlevel, zthreads, frame_bytes,
+                                                seekable_frames_),
+                       kZstdMtBufferSize);
+      } else if (zthreads) {
+        std::cerr << "writing zstd compressed output with " << zthreads
+                  << " threads" << std::endl;
+        outbuf_p->push(zstd_mt_compressor(zlevel, zthreads),
+                       kZstdMtBufferSize);
+      } else {
+        std::cerr << "writing zstd compressed output" << std::endl;
+        outbuf_p->push(boost::iostreams::zstd_compressor(
+            boost::iostreams::zstd_params(zlevel)));
+      }
     } else {
       std::cerr << "writing uncompressed output" << std::endl;
     }
   }
-  outbuf_p->push(boost::iostreams::file_sink(dotfile_));
+  BOOST_IOS::openmode mode = BOOST_IOS::out;
+  if (prealloc_bytes_) {
+    // append, so that opening the sink doesn't truncate the preallocation.
+    int fd = ::open(dotfile_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      preallocate(fd, prealloc_bytes_);
+      ::close(fd);
+    }
+    mode |= BOOST_IOS::app;
+  }
+  if (stats_) {
+    outbuf_p->push(byte_counter(stats_));
+  }
+  outbuf_p->push(boost::iostreams::file_sink(dotfile_, mode));
 }
 
-void SampleWriter::close(size_t overflows) {
-  if (!outbuf_p->empty()) {
+void SampleWriter::close(size_t overflows, size_t overruns) {
+  if (!outbuf_p->empty() || direct_p) {
     std::cerr << "closing " << file_ << std::endl;
     outbuf_p->reset();
+    if (direct_p) {
+      direct_p->close();
+      direct_p.reset();
+    }
+    std::string index_file = file_;
+    if (prealloc_bytes_) {
+      // release preallocated space beyond what was written.
+      boost::filesystem::resize_file(dotfile_,
+                                     boost::filesystem::file_size(dotfile_));
+    }
 
-    if (overflows) {
-      std::string dirname(
-          boost::filesystem::canonical(orig_path_.parent_path()).c_str());
-      std::string overflow_name = dirname + "/overflow-" + file_;
+    if (overflows || overruns) {
+      std::string overflow_name =
+          get_prefix_file(file_, overflows ? "overflow-" : "overrun-");
       rename(dotfile_.c_str(), overflow_name.c_str());
+      index_file = overflow_name;
     } else {
       rename(dotfile_.c_str(), file_.c_str());
     }
+    if (seekable_frames_) {
+      write_seekable_index(index_file + ".idx");
+      seekable_frames_.reset();
+    }
+  }
+}
+
+void SampleWriter::write_seekable_index(const std::string &file) {
+  nlohmann::json index;
+  index["frame_bytes"] =
+      seekable_.frame_bytes / seekable_.unit_bytes * seekable_.unit_bytes;
+  index["unit_bytes"] = seekable_.unit_bytes;
+  index["units_per_second"] = seekable_.units_per_second;
+  index["start_time"] = seekable_.start_time;
+  // [offset, compressed offset, size, compressed size] of each frame.
+  nlohmann::json frames = nlohmann::json::array();
+  for (const auto &frame : *seekable_frames_) {
+    frames.push_back({frame.offset, frame.compressed_offset, frame.size,
+                      frame.compressed_size});
   }
+  index["frames"] = frames;
+  std::ofstream out(file);
+  out << index << std::endl;
 }
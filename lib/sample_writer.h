@@ -2,21 +2,78 @@
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <atomic>
+#include <cstdint>
+#include <vector>
 
 #ifndef SAMPLE_WRITER_H
 #define SAMPLE_WRITER_H 1
+const size_t kDirectIOAlign = 4096;
+
+class DirectWriter;
+
+// Seekable .zst output is compressed in independent frames of frame_bytes
+// (rounded down to whole units, e.g. samples, of unit_bytes), and indexed
+// in a .idx sidecar with units_per_second and the start_time (UNIX seconds)
+// of the first unit, so readers can map a time to a frame. frame_bytes 0
+// writes a single zstd frame, and open() throws if frame_bytes is less than
+// one unit.
+struct SeekableInfo {
+  SeekableInfo()
+      : frame_bytes(0), unit_bytes(1), units_per_second(0), start_time(0) {}
+  size_t frame_bytes, unit_bytes;
+  double units_per_second, start_time;
+};
+
+// A frame's offset and size, compressed and not.
+struct SeekableFrame {
+  uint64_t offset, compressed_offset;
+  uint32_t size, compressed_size;
+};
+
+// Bytes written to a SampleWriter, and to its files (after compression).
+struct WriterStats {
+  WriterStats() : bytes_in(0), bytes_out(0) {}
+  void reset() {
+    bytes_in = 0;
+    bytes_out = 0;
+  }
+  std::atomic<uint64_t> bytes_in, bytes_out;
+};
+
 class SampleWriter {
 public:
   SampleWriter();
-  void open(const std::string &file, size_t zlevel);
-  void close(size_t overflows);
+  ~SampleWriter();
+  // If direct_io is set, uncompressed output bypasses the stream buffer and
+  // page cache (O_DIRECT). If prealloc_bytes > 0, that much file space is
+  // reserved up front for uncompressed output (excess is released on
+  // close). If stats is set,
+  // bytes written (before and after compression) are added to it.
+  void open(const std::string &file, size_t zlevel, size_t zthreads = 0,
+            bool direct_io = false, size_t prealloc_bytes = 0,
+            WriterStats *stats = NULL);
+  // A file with UHD overflows is renamed with an overflow- prefix, otherwise
+  // one with pipeline overruns (dropped sample buffers) with overrun-.
+  void close(size_t overflows, size_t overruns = 0);
   void write(const char *data, size_t len);
+  // Applies to .zst files opened after the call.
+  void set_seekable(const SeekableInfo &seekable) { seekable_ = seekable; }
 
 private:
+  void write_seekable_index(const std::string &file);
+
   boost::scoped_ptr<boost::iostreams::filtering_ostream> outbuf_p;
+  boost::scoped_ptr<DirectWriter> direct_p;
+  size_t prealloc_bytes_;
+  WriterStats *stats_;
   std::string file_;
   std::string dotfile_;
   boost::filesystem::path orig_path_;
+  SeekableInfo seekable_;
+  // frames written (by the compressor filter, which boost copies).
+  boost::shared_ptr<std::vector<SeekableFrame>> seekable_frames_;
 };
 
 std::string get_prefix_file(const std::string &file, const std::string &prefix);
@@ -0,0 +1,537 @@
+#include "specgram.h"
+#include <cstring>
+#include <fftw3.h>
+#include <map>
+#include <mutex>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+void window_samples(const std::complex<short> *in_p,
+                    std::complex<float> *out_p, const float *window2,
+                    size_t nfft, float scale) {
+  const short *i_p = (const short *)in_p;
+  float *o_p = (float *)out_p;
+  const size_t n = nfft * 2;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256 scale_v = _mm256_set1_ps(scale);
+  for (; i + 8 <= n; i += 8) {
+    __m256i s =
+        _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(i_p + i)));
+    __m256 f = _mm256_mul_ps(_mm256_cvtepi32_ps(s), scale_v);
+    _mm256_storeu_ps(o_p + i, _mm256_mul_ps(f, _mm256_loadu_ps(window2 + i)));
+  }
+#elif defined(__SSE2__)
+  const __m128 scale_v = _mm_set1_ps(scale);
+  for (; i + 8 <= n; i += 8) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(i_p + i));
+    // sign extend by unpacking into the high half and shifting down.
+    __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+    __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+    _mm_storeu_ps(o_p + i, _mm_mul_ps(_mm_mul_ps(lo, scale_v),
+                                      _mm_loadu_ps(window2 + i)));
+    _mm_storeu_ps(o_p + i + 4, _mm_mul_ps(_mm_mul_ps(hi, scale_v),
+                                          _mm_loadu_ps(window2 + i + 4)));
+  }
+#elif defined(__ARM_NEON)
+  const float32x4_t scale_v = vdupq_n_f32(scale);
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t s = vld1q_s16(i_p + i);
+    float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(s)));
+    float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(s)));
+    vst1q_f32(o_p + i,
+              vmulq_f32(vmulq_f32(lo, scale_v), vld1q_f32(window2 + i)));
+    vst1q_f32(o_p + i + 4,
+              vmulq_f32(vmulq_f32(hi, scale_v), vld1q_f32(window2 + i + 4)));
+  }
+#endif
+  for (; i < n; ++i) {
+    o_p[i] = i_p[i] * scale * window2[i];
+  }
+}
+
+void window_samples(const std::complex<float> *in_p,
+                    std::complex<float> *out_p, const float *window2,
+                    size_t nfft, float scale) {
+  const float *i_p = (const float *)in_p;
+  float *o_p = (float *)out_p;
+  const size_t n = nfft * 2;
+  size_t i = 0;
+#if defined(__AVX__)
+  const __m256 scale_v = _mm256_set1_ps(scale);
+  for (; i + 8 <= n; i += 8) {
+    __m256 f = _mm256_mul_ps(_mm256_loadu_ps(i_p + i), scale_v);
+    _mm256_storeu_ps(o_p + i, _mm256_mul_ps(f, _mm256_loadu_ps(window2 + i)));
+  }
+#elif defined(__SSE2__)
+  const __m128 scale_v = _mm_set1_ps(scale);
+  for (; i + 4 <= n; i += 4) {
+    __m128 f = _mm_mul_ps(_mm_loadu_ps(i_p + i), scale_v);
+    _mm_storeu_ps(o_p + i, _mm_mul_ps(f, _mm_loadu_ps(window2 + i)));
+  }
+#elif defined(__ARM_NEON)
+  const float32x4_t scale_v = vdupq_n_f32(scale);
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t f = vmulq_f32(vld1q_f32(i_p + i), scale_v);
+    vst1q_f32(o_p + i, vmulq_f32(f, vld1q_f32(window2 + i)));
+  }
+#endif
+  for (; i < n; ++i) {
+    o_p[i] = i_p[i] * scale * window2[i];
+  }
+}
+
+void window_samples(const std::complex<double> *in_p,
+                    std::complex<float> *out_p, const float *window2,
+                    size_t nfft, float scale) {
+  const double *i_p = (const double *)in_p;
+  float *o_p = (float *)out_p;
+  const size_t n = nfft * 2;
+  size_t i = 0;
+#if defined(__AVX__)
+  const __m256 scale_v = _mm256_set1_ps(scale);
+  for (; i + 8 <= n; i += 8) {
+    __m256 f = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(i_p + i + 4)),
+                               _mm256_cvtpd_ps(_mm256_loadu_pd(i_p + i)));
+    f = _mm256_mul_ps(f, scale_v);
+    _mm256_storeu_ps(o_p + i, _mm256_mul_ps(f, _mm256_loadu_ps(window2 + i)));
+  }
+#elif defined(__SSE2__)
+  const __m128 scale_v = _mm_set1_ps(scale);
+  for (; i + 4 <= n; i += 4) {
+    __m128 f = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(i_p + i)),
+                             _mm_cvtpd_ps(_mm_loadu_pd(i_p + i + 2)));
+    f = _mm_mul_ps(f, scale_v);
+    _mm_storeu_ps(o_p + i, _mm_mul_ps(f, _mm_loadu_ps(window2 + i)));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const float32x4_t scale_v = vdupq_n_f32(scale);
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t f = vcombine_f32(vcvt_f32_f64(vld1q_f64(i_p + i)),
+                                 vcvt_f32_f64(vld1q_f64(i_p + i + 2)));
+    f = vmulq_f32(f, scale_v);
+    vst1q_f32(o_p + i, vmulq_f32(f, vld1q_f32(window2 + i)));
+  }
+#endif
+  for (; i < n; ++i) {
+    o_p[i] = float(i_p[i]) * scale * window2[i];
+  }
+}
+
+arma::fvec interleave_window(const arma::fvec &window) {
+  arma::fvec window2(window.size() * 2);
+  for (arma::uword i = 0; i < window.size(); ++i) {
+    window2[i * 2] = window[i];
+    window2[i * 2 + 1] = window[i];
+  }
+  return window2;
+}
+
+// Sum of squares of n values, in blocks short enough for float to sum
+// accurately (which the compiler can vectorize).
+template <typename T> static double sum_squares(const T *p, size_t n) {
+  const size_t kBlock = 1024;
+  double sum = 0;
+  for (size_t i = 0; i < n; i += kBlock) {
+    const size_t m = std::min(kBlock, n - i);
+    float block_sum = 0;
+    for (size_t j = 0; j < m; ++j) {
+      const float v = p[i + j];
+      block_sum += v * v;
+    }
+    sum += block_sum;
+  }
+  return sum;
+}
+
+template <typename T>
+static float mean_power_db(const T *p, size_t n, double full_scale) {
+  if (!n) {
+    return -INFINITY;
+  }
+  return 10 * log10(sum_squares(p, n * 2) / n / (full_scale * full_scale));
+}
+
+float sample_power_db(const std::complex<short> *in_p, size_t n) {
+  return mean_power_db((const short *)in_p, n, 32768);
+}
+
+float sample_power_db(const std::complex<float> *in_p, size_t n) {
+  return mean_power_db((const float *)in_p, n, 1);
+}
+
+float sample_power_db(const std::complex<double> *in_p, size_t n) {
+  return mean_power_db((const double *)in_p, n, 1);
+}
+
+// FFTW planning isn't thread safe (execution is).
+static std::mutex fftw_plan_mutex;
+static std::map<std::pair<size_t, size_t>, fftwf_plan> fftw_plans;
+static bool fftw_wisdom_loaded = false, fftw_plans_added = false;
+
+fftwf_plan get_fftw_plan(size_t nfft, size_t batch) {
+  std::lock_guard<std::mutex> lock(fftw_plan_mutex);
+  const auto key = std::make_pair(nfft, batch);
+  auto it = fftw_plans.find(key);
+  if (it != fftw_plans.end()) {
+    return it->second;
+  }
+  // plan with scratch buffers, as FFTW_MEASURE overwrites them.
+  fftwf_complex *in = fftwf_alloc_complex(nfft * batch);
+  fftwf_complex *out = fftwf_alloc_complex(nfft * batch);
+  const int n = nfft;
+  fftwf_plan plan = fftwf_plan_many_dft(1, &n, batch, in, NULL, 1, n, out,
+                                        NULL, 1, n, FFTW_FORWARD, FFTW_MEASURE);
+  fftwf_free(in);
+  fftwf_free(out);
+  fftw_plans[key] = plan;
+  fftw_plans_added = true;
+  return plan;
+}
+
+void specgram_plan(size_t nfft, size_t batch) { get_fftw_plan(nfft, batch); }
+
+void specgram_load_wisdom(const std::string &wisdom_file) {
+  std::lock_guard<std::mutex> lock(fftw_plan_mutex);
+  if (!fftw_wisdom_loaded && wisdom_file.size()) {
+    fftw_wisdom_loaded = true;
+    if (fftwf_import_wisdom_from_filename(wisdom_file.c_str())) {
+      std::cerr << "loaded FFTW wisdom from " << wisdom_file << std::endl;
+    }
+  }
+}
+
+void specgram_save_wisdom(const std::string &wisdom_file) {
+  std::lock_guard<std::mutex> lock(fftw_plan_mutex);
+  if (fftw_plans_added && wisdom_file.size()) {
+    fftw_plans_added = false;
+    if (!fftwf_export_wisdom_to_filename(wisdom_file.c_str())) {
+      std::cerr << "cannot save FFTW wisdom to " << wisdom_file << std::endl;
+    }
+  }
+}
+
+void specgram_free_plans() {
+  std::lock_guard<std::mutex> lock(fftw_plan_mutex);
+  for (auto &plan : fftw_plans) {
+    fftwf_destroy_plan(plan.second);
+  }
+  fftw_plans.clear();
+}
+
+void specgram_offload(arma::cx_fmat &Pw_in, arma::cx_fmat &Pw) {
+  const size_t nfft_rows = Pw_in.n_rows;
+  if (!Pw_in.n_cols) {
+    return;
+  }
+  fftwf_complex *in = (fftwf_complex *)Pw_in.memptr();
+  fftwf_complex *out = (fftwf_complex *)Pw.memptr();
+
+  // The plan's SIMD alignment must match the buffers it is executed on.
+  if (!fftwf_alignment_of((float *)in) && !fftwf_alignment_of((float *)out)) {
+    fftwf_execute_dft(get_fftw_plan(nfft_rows, Pw_in.n_cols), in, out);
+    return;
+  }
+  for (arma::uword k = 0; k < Pw_in.n_cols; ++k) {
+    Pw.col(k) = arma::fft(Pw_in.col(k), nfft_rows);
+  }
+}
+
+// 10 * log10(2), to convert log2 to dB.
+const float kDbPerLog2 = 3.01029996f;
+// log2(1 + t) ~= t * (c1 + t * (c2 + t * (c3 + t * c4))) for t in [0, 1),
+// least squares fit with max error 1.9e-4 (0.0006 dB).
+const float kLog2C1 = 1.43854793f, kLog2C2 = -0.67808946f,
+            kLog2C3 = 0.32364631f, kLog2C4 = -0.08429466f;
+
+inline float fast_log2(float x) {
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  const float e = float(int32_t(bits >> 23) - 127);
+  bits = (bits & 0x7fffff) | 0x3f800000;
+  float t;
+  memcpy(&t, &bits, sizeof(t));
+  t -= 1;
+  return e + t * (kLog2C1 + t * (kLog2C2 + t * (kLog2C3 + t * kLog2C4)));
+}
+
+#if defined(__AVX2__)
+inline __m256 fast_log2(__m256 x) {
+  const __m256i bits = _mm256_castps_si256(x);
+  const __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(
+      _mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+  __m256 t = _mm256_castsi256_ps(
+      _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x7fffff)),
+                      _mm256_set1_epi32(0x3f800000)));
+  t = _mm256_sub_ps(t, _mm256_set1_ps(1));
+  __m256 p = _mm256_add_ps(_mm256_set1_ps(kLog2C3),
+                           _mm256_mul_ps(t, _mm256_set1_ps(kLog2C4)));
+  p = _mm256_add_ps(_mm256_set1_ps(kLog2C2), _mm256_mul_ps(t, p));
+  p = _mm256_add_ps(_mm256_set1_ps(kLog2C1), _mm256_mul_ps(t, p));
+  return _mm256_add_ps(e, _mm256_mul_ps(t, p));
+}
+#elif defined(__SSE2__)
+inline __m128 fast_log2(__m128 x) {
+  const __m128i bits = _mm_castps_si128(x);
+  const __m128 e = _mm_cvtepi32_ps(
+      _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+  __m128 t = _mm_castsi128_ps(
+      _mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)),
+                   _mm_set1_epi32(0x3f800000)));
+  t = _mm_sub_ps(t, _mm_set1_ps(1));
+  __m128 p = _mm_add_ps(_mm_set1_ps(kLog2C3),
+                        _mm_mul_ps(t, _mm_set1_ps(kLog2C4)));
+  p = _mm_add_ps(_mm_set1_ps(kLog2C2), _mm_mul_ps(t, p));
+  p = _mm_add_ps(_mm_set1_ps(kLog2C1), _mm_mul_ps(t, p));
+  return _mm_add_ps(e, _mm_mul_ps(t, p));
+}
+#elif defined(__ARM_NEON)
+inline float32x4_t fast_log2(float32x4_t x) {
+  const uint32x4_t bits = vreinterpretq_u32_f32(x);
+  const float32x4_t e = vcvtq_f32_s32(vsubq_s32(
+      vreinterpretq_s32_u32(vshrq_n_u32(bits, 23)), vdupq_n_s32(127)));
+  float32x4_t t = vreinterpretq_f32_u32(vorrq_u32(
+      vandq_u32(bits, vdupq_n_u32(0x7fffff)), vdupq_n_u32(0x3f800000)));
+  t = vsubq_f32(t, vdupq_n_f32(1));
+  float32x4_t p = vmlaq_f32(vdupq_n_f32(kLog2C3), t, vdupq_n_f32(kLog2C4));
+  p = vmlaq_f32(vdupq_n_f32(kLog2C2), t, p);
+  p = vmlaq_f32(vdupq_n_f32(kLog2C1), t, p);
+  return vmlaq_f32(e, t, p);
+}
+#endif
+
+// |X|^2 of the next 8 (AVX2) or 4 bins from interleaved re, im.
+#if defined(__AVX2__)
+inline __m256 bin_power(const float *i_p) {
+  __m256 a = _mm256_loadu_ps(i_p);
+  __m256 b = _mm256_loadu_ps(i_p + 8);
+  a = _mm256_mul_ps(a, a);
+  b = _mm256_mul_ps(b, b);
+  // re^2 + im^2, in bin order 0, 1, 4, 5, 2, 3, 6, 7 until permuted.
+  __m256 p = _mm256_add_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+                           _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+  return _mm256_castpd_ps(
+      _mm256_permute4x64_pd(_mm256_castps_pd(p), _MM_SHUFFLE(3, 1, 2, 0)));
+}
+const size_t kBinsPerVec = 8;
+#elif defined(__SSE2__)
+inline __m128 bin_power(const float *i_p) {
+  __m128 a = _mm_loadu_ps(i_p);
+  __m128 b = _mm_loadu_ps(i_p + 4);
+  a = _mm_mul_ps(a, a);
+  b = _mm_mul_ps(b, b);
+  return _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+                    _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+const size_t kBinsPerVec = 4;
+#elif defined(__ARM_NEON)
+inline float32x4_t bin_power(const float *i_p) {
+  float32x4x2_t x = vld2q_f32(i_p);
+  return vmlaq_f32(vmulq_f32(x.val[0], x.val[0]), x.val[1], x.val[1]);
+}
+const size_t kBinsPerVec = 4;
+#endif
+
+// log2 to dB, plus offset_db.
+#if defined(__AVX2__)
+inline __m256 to_db(__m256 p, float offset_db) {
+  return _mm256_add_ps(
+      _mm256_mul_ps(fast_log2(p), _mm256_set1_ps(kDbPerLog2)),
+      _mm256_set1_ps(offset_db));
+}
+#elif defined(__SSE2__)
+inline __m128 to_db(__m128 p, float offset_db) {
+  return _mm_add_ps(_mm_mul_ps(fast_log2(p), _mm_set1_ps(kDbPerLog2)),
+                    _mm_set1_ps(offset_db));
+}
+#elif defined(__ARM_NEON)
+inline float32x4_t to_db(float32x4_t p, float offset_db) {
+  return vmlaq_f32(vdupq_n_f32(offset_db), fast_log2(p),
+                   vdupq_n_f32(kDbPerLog2));
+}
+#endif
+
+inline float to_db(float p, float offset_db) {
+  return fast_log2(p) * kDbPerLog2 + offset_db;
+}
+
+#if defined(__AVX2__)
+inline void store_bins(float *out_p, __m256 v) { _mm256_storeu_ps(out_p, v); }
+inline __m256 load_bins(const float *in_p) { return _mm256_loadu_ps(in_p); }
+#elif defined(__SSE2__)
+inline void store_bins(float *out_p, __m128 v) { _mm_storeu_ps(out_p, v); }
+inline __m128 load_bins(const float *in_p) { return _mm_loadu_ps(in_p); }
+#elif defined(__ARM_NEON)
+inline void store_bins(float *out_p, float32x4_t v) { vst1q_f32(out_p, v); }
+inline float32x4_t load_bins(const float *in_p) { return vld1q_f32(in_p); }
+#endif
+
+void power_db_run(const std::complex<float> *in_p, float *out_p, size_t n,
+                  float offset_db) {
+  const float *i_p = (const float *)in_p;
+  size_t i = 0;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+  for (; i + kBinsPerVec <= n; i += kBinsPerVec) {
+    store_bins(out_p + i, to_db(bin_power(i_p + i * 2), offset_db));
+  }
+#endif
+  for (; i < n; ++i) {
+    out_p[i] = to_db(std::norm(in_p[i]), offset_db);
+  }
+}
+
+void power_run(const std::complex<float> *in_p, float *out_p, size_t n) {
+  const float *i_p = (const float *)in_p;
+  size_t i = 0;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+  for (; i + kBinsPerVec <= n; i += kBinsPerVec) {
+    store_bins(out_p + i, bin_power(i_p + i * 2));
+  }
+#endif
+  for (; i < n; ++i) {
+    out_p[i] = std::norm(in_p[i]);
+  }
+}
+
+void db_run(const float *in_p, float *out_p, size_t n, float offset_db) {
+  size_t i = 0;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+  for (; i + kBinsPerVec <= n; i += kBinsPerVec) {
+    store_bins(out_p + i, to_db(load_bins(in_p + i), offset_db));
+  }
+#endif
+  for (; i < n; ++i) {
+    out_p[i] = to_db(in_p[i], offset_db);
+  }
+}
+
+void power_db(const std::complex<float> *in_p, float *out_p, size_t nfft,
+              float window_sum, bool fftshift) {
+  const float offset_db = -kDbPerLog2 * log2f(window_sum);
+  if (!fftshift) {
+    power_db_run(in_p, out_p, nfft, offset_db);
+    return;
+  }
+  const size_t shift = nfft / 2;
+  power_db_run(in_p, out_p + shift, nfft - shift, offset_db);
+  power_db_run(in_p + nfft - shift, out_p, shift, offset_db);
+}
+
+SpecgramAverage::SpecgramAverage()
+    : mode_(kMean), nfft_(0), K_(1), D_(1), frame_(0), offset_db_(0),
+      bin_max_(false), fftshift_(false), started_(false) {}
+
+void SpecgramAverage::reset(const std::string &mode, size_t nfft, size_t K,
+                            size_t D, bool bin_max, float window_sum,
+                            bool fftshift) {
+  if (mode == "mean") {
+    mode_ = kMean;
+  } else if (mode == "max") {
+    mode_ = kMax;
+  } else if (mode == "min") {
+    mode_ = kMin;
+  } else if (mode == "ema") {
+    mode_ = kEma;
+  } else {
+    throw std::runtime_error("Unknown FFT average mode " + mode);
+  }
+  nfft_ = nfft;
+  K_ = std::max(K, size_t(1));
+  D_ = std::max(D, size_t(1));
+  if (nfft_ % D_) {
+    throw std::runtime_error("FFT bin decimation must be a factor of nfft");
+  }
+  frame_ = 0;
+  offset_db_ = -kDbPerLog2 * log2f(window_sum);
+  if (mode_ == kMean) {
+    // the accumulator holds the sum of K frames.
+    offset_db_ -= kDbPerLog2 * log2f(K_);
+  }
+  bin_max_ = bin_max;
+  if (!bin_max_) {
+    // and each decimated bin, the sum of D bins.
+    offset_db_ -= kDbPerLog2 * log2f(D_);
+  }
+  fftshift_ = fftshift;
+  started_ = false;
+  power_.resize(nfft_);
+  acc_.resize(nfft_);
+  bins_.resize(nfft_ / D_);
+}
+
+void SpecgramAverage::add(const arma::cx_fmat &Pw,
+                          std::vector<float> &fft_points_out) {
+  fft_points_out.clear();
+  float *acc_p = acc_.data();
+  const float *p_p = power_.data();
+  const float ema_weight = 1.0 / K_;
+  for (arma::uword m = 0; m < Pw.n_cols; ++m) {
+    if (!frame_ && (mode_ != kEma || !started_)) {
+      power_run(Pw.colptr(m), acc_p, nfft_);
+      started_ = true;
+    } else {
+      power_run(Pw.colptr(m), power_.data(), nfft_);
+      switch (mode_) {
+      case kMean:
+        for (size_t i = 0; i < nfft_; ++i) {
+          acc_p[i] += p_p[i];
+        }
+        break;
+      case kMax:
+        for (size_t i = 0; i < nfft_; ++i) {
+          acc_p[i] = acc_p[i] > p_p[i] ? acc_p[i] : p_p[i];
+        }
+        break;
+      case kMin:
+        for (size_t i = 0; i < nfft_; ++i) {
+          acc_p[i] = acc_p[i] < p_p[i] ? acc_p[i] : p_p[i];
+        }
+        break;
+      case kEma:
+        for (size_t i = 0; i < nfft_; ++i) {
+          acc_p[i] += (p_p[i] - acc_p[i]) * ema_weight;
+        }
+        break;
+      }
+    }
+    if (++frame_ == K_) {
+      frame_ = 0;
+      const float *bins_p = acc_p;
+      const size_t bins = bins_.size();
+      if (D_ > 1) {
+        for (size_t i = 0; i < bins; ++i) {
+          const float *b_p = acc_p + i * D_;
+          float bin = b_p[0];
+          for (size_t j = 1; j < D_; ++j) {
+            bin = bin_max_ ? std::max(bin, b_p[j]) : bin + b_p[j];
+          }
+          bins_[i] = bin;
+        }
+        bins_p = bins_.data();
+      }
+      const size_t out = fft_points_out.size();
+      fft_points_out.resize(out + bins);
+      float *out_p = fft_points_out.data() + out;
+      if (fftshift_) {
+        const size_t shift = bins / 2;
+        db_run(bins_p, out_p + shift, bins - shift, offset_db_);
+        db_run(bins_p + bins - shift, out_p, shift, offset_db_);
+      } else {
+        db_run(bins_p, out_p, bins, offset_db_);
+      }
+    }
+  }
+}
+
+void specgram_power_db(const arma::cx_fmat &Pw, float window_sum,
+                       arma::fmat &fft_points_out, bool fftshift) {
+  fft_points_out.set_size(Pw.n_rows, Pw.n_cols);
+  for (arma::uword m = 0; m < Pw.n_cols; ++m) {
+    power_db(Pw.colptr(m), fft_points_out.colptr(m), Pw.n_rows, window_sum,
+             fftshift);
+  }
+}
@@ -0,0 +1,145 @@
+#include <armadillo>
+
+#ifndef SPECGRAM_H
+#define SPECGRAM_H 1
+// Convert nfft samples to complex float, multiplying by scale and window,
+// into out_p. window2 holds each window coefficient twice (see
+// interleave_window()), for the real and imaginary parts.
+void window_samples(const std::complex<short> *in_p,
+                    std::complex<float> *out_p, const float *window2,
+                    size_t nfft, float scale);
+void window_samples(const std::complex<float> *in_p,
+                    std::complex<float> *out_p, const float *window2,
+                    size_t nfft, float scale);
+void window_samples(const std::complex<double> *in_p,
+                    std::complex<float> *out_p, const float *window2,
+                    size_t nfft, float scale);
+arma::fvec interleave_window(const arma::fvec &window);
+// Mean power of n samples in dBFS (full scale is 32768 for short samples,
+// otherwise 1).
+float sample_power_db(const std::complex<short> *in_p, size_t n);
+float sample_power_db(const std::complex<float> *in_p, size_t n);
+float sample_power_db(const std::complex<double> *in_p, size_t n);
+
+// Window N samples into Pw_in, one column per FFT.
+template <typename samp_type>
+void specgram_window(const samp_type *samples_in, const arma::uword N,
+                     arma::cx_fmat &Pw_in, const arma::fvec &window2,
+                     const arma::uword Nfft, const arma::uword Noverl,
+                     float scale = 1) {
+  const arma::uword D = Nfft - Noverl;
+  const arma::uword U =
+      static_cast<arma::uword>(floor((N - Noverl) / double(D)));
+  Pw_in.set_size(Nfft, U);
+
+  for (arma::uword m = 0; m < U; ++m) {
+    window_samples(samples_in + m * D, Pw_in.colptr(m), window2.memptr(),
+                   Nfft, scale);
+  }
+}
+
+// Splits a stream of samples, delivered in buffers of any size, into frames
+// of Nfft samples every Nfft - Noverl samples. Frames within a buffer are
+// returned in place; only the samples of frames spanning buffers are copied.
+template <typename samp_type> class SpecgramFrames {
+public:
+  SpecgramFrames() : Nfft_(0), D_(0), in_(NULL), N_(0), next_(0) {}
+
+  void reset(arma::uword Nfft, arma::uword Noverl) {
+    Nfft_ = Nfft;
+    D_ = Nfft - Noverl;
+    history_.clear();
+    history_.reserve(Nfft);
+    scratch_.resize(Nfft);
+    in_ = NULL;
+    N_ = 0;
+    next_ = 0;
+  }
+
+  // Start the next buffer. next() must then be called until it returns NULL,
+  // so the samples of any incomplete frame are carried over.
+  void set_buffer(const samp_type *samples_in, arma::uword N) {
+    in_ = samples_in;
+    N_ = N;
+  }
+
+  // Returns the next frame, or NULL if it extends past the current buffer.
+  const samp_type *next() {
+    const arma::uword H = history_.size();
+    if (next_ + Nfft_ > H + N_) {
+      carry();
+      return NULL;
+    }
+    const samp_type *frame_p = scratch_.data();
+    if (next_ < H) {
+      std::copy(history_.begin() + next_, history_.end(), scratch_.begin());
+      std::copy(in_, in_ + Nfft_ - (H - next_),
+                scratch_.begin() + (H - next_));
+    } else {
+      frame_p = in_ + (next_ - H);
+    }
+    next_ += D_;
+    return frame_p;
+  }
+
+private:
+  // Keep the samples from the next frame onwards (fewer than Nfft).
+  void carry() {
+    const arma::uword H = history_.size();
+    const arma::uword keep = std::min(next_, H);
+    history_.erase(history_.begin(), history_.begin() + keep);
+    history_.insert(history_.end(), in_ + (std::max(next_, H) - H),
+                    in_ + N_);
+    in_ = NULL;
+    N_ = 0;
+    next_ = 0;
+  }
+
+  arma::uword Nfft_, D_;
+  std::vector<samp_type> history_, scratch_;
+  const samp_type *in_;
+  arma::uword N_, next_;
+};
+
+// CPU FFT of each column of Pw_in into Pw, using a cached batched FFTW plan
+// per (nfft, columns).
+void specgram_offload(arma::cx_fmat &Pw_in, arma::cx_fmat &Pw);
+// Create (or load from wisdom) the plan for nfft x batch ahead of first use.
+void specgram_plan(size_t nfft, size_t batch);
+// Load/save FFTW wisdom, so plans needn't be re-measured on each run.
+void specgram_load_wisdom(const std::string &wisdom_file);
+void specgram_save_wisdom(const std::string &wisdom_file);
+// Destroy the cached plans (none may be executing).
+void specgram_free_plans();
+// Write 10 * log10(|X|^2 / window_sum) of nfft bins to out_p, using a fast
+// approximate log (within 0.001 dB; 0 gives about -383 dB rather than
+// -inf). If fftshift is set, bin 0 (DC) is moved to out_p[nfft / 2].
+void power_db(const std::complex<float> *in_p, float *out_p, size_t nfft,
+              float window_sum, bool fftshift);
+// power_db() of each column of Pw into fft_points_out, which is only
+// reallocated if its size changes.
+void specgram_power_db(const arma::cx_fmat &Pw, float window_sum,
+                       arma::fmat &fft_points_out, bool fftshift = false);
+
+// Integrates frames in the power domain, writing one dB frame (as
+// power_db()) per K frames added, optionally reduced to nfft / D bins.
+class SpecgramAverage {
+public:
+  SpecgramAverage();
+  // mode is mean, max, min or ema (exponential, weighting each frame 1/K).
+  // Each D adjacent bins are reduced to their mean, or max if bin_max is set.
+  void reset(const std::string &mode, size_t nfft, size_t K, size_t D,
+             bool bin_max, float window_sum, bool fftshift);
+  // Add each column of Pw, replacing fft_points_out with the frames
+  // completed (all nfft / D bins of each frame, in order).
+  void add(const arma::cx_fmat &Pw, std::vector<float> &fft_points_out);
+
+private:
+  enum Mode { kMean, kMax, kMin, kEma };
+  Mode mode_;
+  size_t nfft_, K_, D_, frame_;
+  float offset_db_;
+  bool bin_max_, fftshift_, started_;
+  std::vector<float> power_, acc_, bins_;
+};
+#endif
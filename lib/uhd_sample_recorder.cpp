@@ -1,10 +1,15 @@
+#include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/program_options.hpp>
+#include <cctype>
 #include <chrono>
+#include <condition_variable>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <thread>
 #include <uhd/exception.hpp>
 #include <uhd/types/tune_request.hpp>
@@ -14,17 +19,32 @@
 
 #include "json.hpp"
 
+#include "buffer_arena.h"
+#include "pipeline_stats.h"
 #include "sample_pipeline.h"
+#include "sample_source.h"
 #include "sample_writer.h"
 
 using json = nlohmann::json;
 namespace po = boost::program_options;
 
-std::string uhd_args, file, fft_file, type, ant, subdev, ref, wirefmt;
-size_t channel, total_num_samps, spb, zlevel, rate, nfft, nfft_overlap,
-    nfft_div, nfft_ds, batches, sample_id;
-double option_rate, freq, gain, bw, total_time, setup_time, lo_offset;
-bool null, fftnull, use_vkfft, use_json_args, int_n, skip_lo;
+std::string uhd_args, file, fft_file, type, ant, subdev, ref, wirefmt,
+    replay_file, tones, fftw_wisdom, vkfft_cache_dir, fft_avg, fft_encoding,
+    fft_bin_decimation_mode, numa_node_option, channels_option,
+    prometheus_file, snapshot_file;
+std::vector<size_t> channels;
+std::vector<std::string> ddc_options;
+std::vector<DDCSpec> ddc_specs;
+size_t channel, total_num_samps, spb, zlevel, zthreads, rate, nfft,
+    nfft_overlap, nfft_div, nfft_ds, batches, sample_id, buffer_mb,
+    fft_threads, fft_avg_frames, fft_bin_decimation, rotate_mb,
+    seekable_frame_kb;
+double option_rate, freq, gain, bw, total_time, setup_time, lo_offset, noise,
+    fft_db_min, fft_db_max, rotate_seconds, stats_interval, trigger_dbfs,
+    trigger_pre_seconds, trigger_hang_seconds, history_seconds;
+int numa_node;
+bool null, fftnull, use_vkfft, use_json_args, int_n, skip_lo, synthetic,
+    unpaced, direct_io, fftshift;
 static bool stop_streaming;
 po::variables_map vm;
 
@@ -98,11 +118,106 @@ void tune(uhd::usrp::multi_usrp::sptr usrp, size_t channel, double freq,
 
 void sig_int_handler(int) { stop_streaming = true; }
 
+// JSON status lines may be written by the stats reporter while recording.
+static std::mutex stdout_mutex;
+static std::mutex stats_mutex;
+static std::condition_variable stats_cv;
+static bool stats_done;
+static std::thread stats_thread;
+// With --json, stdin is read by stdin_worker, which takes snapshots (even
+// while recording) and queues other requests. requests_mutex also guards
+// snapshot_file.
+static std::mutex requests_mutex;
+static std::condition_variable requests_cv;
+static std::deque<std::string> requests;
+static bool requests_done;
+
+json channels_stats_json() {
+  json stats = json::array();
+  for (size_t i = 0; i < channels.size(); ++i) {
+    SamplePipeline &pipeline = get_sample_pipeline(i);
+    json channel_stats = pipeline_stats_json(pipeline.get_stats());
+    channel_stats["channel"] = channels[i];
+    channel_stats["pipeline_overruns"] = pipeline.get_pipeline_overruns();
+    stats.push_back(channel_stats);
+  }
+  return stats;
+}
+
+void write_stats_prometheus() {
+  std::vector<std::pair<std::string, const PipelineStats *>> pipelines;
+  std::string overruns =
+      "# HELP uhd_sample_recorder_pipeline_overruns_total Sample buffers "
+      "dropped because the pipeline was full.\n"
+      "# TYPE uhd_sample_recorder_pipeline_overruns_total counter\n";
+  for (size_t i = 0; i < channels.size(); ++i) {
+    SamplePipeline &pipeline = get_sample_pipeline(i);
+    const std::string labels =
+        "channel=\"" + std::to_string(channels[i]) + "\"";
+    pipelines.push_back(std::make_pair(labels, &pipeline.get_stats()));
+    overruns += "uhd_sample_recorder_pipeline_overruns_total{" + labels +
+                "} " + std::to_string(pipeline.get_pipeline_overruns()) +
+                "\n";
+  }
+  try {
+    write_prometheus_file(prometheus_file,
+                          pipeline_stats_prometheus(pipelines) + overruns);
+  } catch (std::runtime_error &ex) {
+    std::cerr << ex.what() << std::endl;
+  }
+}
+
+// Every stats_interval seconds while recording, update the Prometheus file
+// and (with --json) write a status line with the pipeline stats.
+void stats_worker() {
+  std::unique_lock<std::mutex> lock(stats_mutex);
+  while (!stats_cv.wait_for(
+      lock, std::chrono::milliseconds(int64_t(stats_interval * 1000)),
+      [] { return stats_done; })) {
+    if (prometheus_file.size()) {
+      write_stats_prometheus();
+    }
+    if (use_json_args) {
+      json status;
+      status["recording"] = true;
+      status["stats"] = channels_stats_json();
+      std::lock_guard<std::mutex> stdout_lock(stdout_mutex);
+      std::cout << status << std::endl;
+    }
+  }
+}
+
+void start_stats_reporter() {
+  if (stats_interval > 0) {
+    stats_done = false;
+    stats_thread = std::thread(stats_worker);
+  }
+}
+
+void stop_stats_reporter() {
+  if (stats_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      stats_done = true;
+    }
+    stats_cv.notify_all();
+    stats_thread.join();
+  }
+  if (prometheus_file.size()) {
+    write_stats_prometheus();
+  }
+}
+
+// Each channel is received into its own pipeline. Channels are received
+// together, so if any pipeline has no free buffer, all channels drop the
+// samples, keeping their files sample aligned.
 bool run_stream(uhd::rx_streamer::sptr rx_stream, double time_requested,
                 size_t max_samples, size_t num_requested_samples) {
   bool overflows = false;
-  size_t write_ptr = 0;
   size_t num_total_samps = 0;
+  std::vector<size_t> write_ptrs(channels.size());
+  std::vector<size_t> buffer_capacities(channels.size());
+  std::vector<void *> buffs(channels.size());
   const auto stop_time =
       std::chrono::steady_clock::now() +
       std::chrono::milliseconds(int64_t(1000 * time_requested));
@@ -110,10 +225,22 @@ bool run_stream(uhd::rx_streamer::sptr rx_stream, double time_requested,
 
   for (;;) {
     uhd::rx_metadata_t md;
-    size_t buffer_capacity = 0;
-    char *buffer_p = get_sample_buffer(write_ptr, &buffer_capacity);
-    size_t num_rx_samps =
-        rx_stream->recv(buffer_p, max_samples, md, 3.0, false);
+    bool discard = false;
+    for (size_t i = 0; i < channels.size(); ++i) {
+      SamplePipeline &pipeline = get_sample_pipeline(i);
+      const size_t overruns = pipeline.get_pipeline_overruns();
+      write_ptrs[i] = pipeline.acquire_sample_buffer();
+      discard = discard || pipeline.get_pipeline_overruns() != overruns;
+    }
+    for (size_t i = 0; i < channels.size(); ++i) {
+      SamplePipeline &pipeline = get_sample_pipeline(i);
+      if (discard) {
+        write_ptrs[i] = pipeline.discard_sample_buffer(write_ptrs[i]);
+      }
+      buffs[i] =
+          pipeline.get_sample_buffer(write_ptrs[i], &buffer_capacities[i]);
+    }
+    size_t num_rx_samps = rx_stream->recv(buffs, max_samples, md, 3.0, false);
 
     switch (md.error_code) {
     case uhd::rx_metadata_t::ERROR_CODE_NONE:
@@ -135,14 +262,16 @@ bool run_stream(uhd::rx_streamer::sptr rx_stream, double time_requested,
 
     num_total_samps += num_rx_samps;
     size_t samp_bytes = num_rx_samps * get_samp_size();
-    if (samp_bytes != buffer_capacity) {
-      std::cerr << "resize to " << samp_bytes << " from " << buffer_capacity
-                << std::endl;
-      set_sample_buffer_capacity(write_ptr, samp_bytes);
+    for (size_t i = 0; i < channels.size(); ++i) {
+      SamplePipeline &pipeline = get_sample_pipeline(i);
+      if (samp_bytes != buffer_capacities[i]) {
+        std::cerr << "resize to " << samp_bytes << " from "
+                  << buffer_capacities[i] << std::endl;
+        pipeline.set_sample_buffer_capacity(write_ptrs[i], samp_bytes);
+      }
+      pipeline.enqueue_samples(write_ptrs[i]);
     }
 
-    enqueue_samples(write_ptr);
-
     if (stop_streaming)
       break;
     if (num_requested_samples and num_requested_samples >= num_total_samps)
@@ -154,11 +283,87 @@ bool run_stream(uhd::rx_streamer::sptr rx_stream, double time_requested,
   return overflows;
 }
 
-void sample_record(uhd::usrp::multi_usrp::sptr usrp, const std::string &type,
-                   const std::string &wire_format, const size_t &channel,
-                   const std::string &file, const std::string &fft_file,
-                   const size_t rate, const size_t samps_per_buff,
-                   const size_t zlevel, const size_t num_requested_samples,
+// The rx_streamer is created once, by main, and kept between captures (e.g.
+// from successive --json requests), since type, wire format and channels
+// don't change.
+uhd::rx_streamer::sptr get_rx_stream(uhd::usrp::multi_usrp::sptr usrp,
+                                     const std::string &type,
+                                     const std::string &wire_format,
+                                     const std::vector<size_t> &channels) {
+  std::string cpu_format;
+  set_sample_pipeline_types(type, cpu_format);
+  uhd::stream_args_t stream_args(cpu_format, wire_format);
+  stream_args.channels = channels;
+  return usrp->get_rx_stream(stream_args);
+}
+
+// Discards samples still in flight after a stop, so the next capture
+// doesn't start with them.
+void drain_rx_stream(uhd::rx_streamer::sptr rx_stream) {
+  const size_t max_samps = rx_stream->get_max_num_samps();
+  std::vector<std::vector<char>> buffers(
+      channels.size(), std::vector<char>(max_samps * get_samp_size()));
+  std::vector<void *> buffs;
+  for (auto &buffer : buffers) {
+    buffs.push_back(buffer.data());
+  }
+  uhd::rx_metadata_t md;
+  do {
+    rx_stream->recv(buffs, max_samps, md, 0.1);
+  } while (md.error_code != uhd::rx_metadata_t::ERROR_CODE_TIMEOUT);
+}
+
+std::string prefix_file(const std::string &file, const std::string &prefix) {
+  if (file.find('%') != std::string::npos) {
+    // a name template's directories may not exist yet.
+    boost::filesystem::path file_path(file);
+    return (file_path.parent_path() / (prefix + file_path.filename().string()))
+        .string();
+  }
+  return get_prefix_file(file, prefix);
+}
+
+// With several channels, each channel's files are prefixed with ch<n>_.
+std::string channel_file(const std::string &file, size_t channel) {
+  if (channels.size() < 2 || file.empty()) {
+    return file;
+  }
+  return prefix_file(file, "ch" + std::to_string(channel) + "_");
+}
+
+// Sub-bands and snapshots are written to files named after the sample file
+// (even with --null), prefixed with ddc_<freq>_ and snapshot_.
+void set_derived_files(const std::string &file) {
+  for (auto &spec : ddc_specs) {
+    spec.file =
+        prefix_file(file, "ddc_" + std::to_string(int64_t(spec.freq)) + "_");
+  }
+  std::lock_guard<std::mutex> lock(requests_mutex);
+  snapshot_file = prefix_file(file, "snapshot_");
+}
+
+void set_channel_ddcs(size_t pipeline, size_t channel) {
+  std::vector<DDCSpec> specs(ddc_specs);
+  for (auto &spec : specs) {
+    spec.file = channel_file(spec.file, channel);
+  }
+  get_sample_pipeline(pipeline).set_ddcs(specs);
+}
+
+size_t channels_pipeline_overruns() {
+  size_t overruns = 0;
+  for (size_t i = 0; i < std::max(channels.size(), size_t(1)); ++i) {
+    overruns += get_sample_pipeline(i).get_pipeline_overruns();
+  }
+  return overruns;
+}
+
+void sample_record(uhd::usrp::multi_usrp::sptr usrp,
+                   uhd::rx_streamer::sptr rx_stream, const std::string &type,
+                   const std::string &file,
+                   const std::string &fft_file, const size_t rate,
+                   const size_t samps_per_buff, const size_t zlevel,
+                   const size_t num_requested_samples,
                    const double time_requested, const bool use_vkfft,
                    const size_t nfft, const size_t nfft_overlap,
                    const size_t nfft_div, const size_t nfft_ds,
@@ -166,12 +371,6 @@ void sample_record(uhd::usrp::multi_usrp::sptr usrp, const std::string &type,
   std::string cpu_format;
   set_sample_pipeline_types(type, cpu_format);
 
-  uhd::stream_args_t stream_args(cpu_format, wire_format);
-  std::vector<size_t> channel_nums;
-  channel_nums.push_back(channel);
-  stream_args.channels = channel_nums;
-  uhd::rx_streamer::sptr rx_stream = usrp->get_rx_stream(stream_args);
-
   const size_t max_samps_per_packet = rx_stream->get_max_num_samps();
   const size_t max_samples = std::max(max_samps_per_packet, samps_per_buff);
   std::cerr << "max_samps_per_packet from stream: " << max_samps_per_packet
@@ -185,9 +384,16 @@ void sample_record(uhd::usrp::multi_usrp::sptr usrp, const std::string &type,
     }
   }
 
-  sample_pipeline_start(file, fft_file, max_samples, zlevel, use_vkfft, nfft,
-                        nfft_overlap, nfft_div, nfft_ds, rate, batches,
-                        sample_id);
+  set_sample_pipeline_prealloc_samples(
+      num_requested_samples ? num_requested_samples
+                            : size_t(time_requested * rate));
+  for (size_t i = 0; i < channels.size(); ++i) {
+    set_channel_ddcs(i, channels[i]);
+    get_sample_pipeline(i).start(
+        channel_file(file, channels[i]), channel_file(fft_file, channels[i]),
+        max_samples, zlevel, use_vkfft, nfft, nfft_overlap, nfft_div, nfft_ds,
+        rate, batches, sample_id);
+  }
 
   uhd::stream_cmd_t stream_cmd(
       (num_requested_samples == 0)
@@ -196,16 +402,86 @@ void sample_record(uhd::usrp::multi_usrp::sptr usrp, const std::string &type,
   stream_cmd.num_samps = size_t(num_requested_samples);
   stream_cmd.stream_now = true;
   stream_cmd.time_spec = uhd::time_spec_t();
+  if (channels.size() > 1) {
+    // start all channels on the same sample.
+    stream_cmd.stream_now = false;
+    stream_cmd.time_spec = usrp->get_time_now() + uhd::time_spec_t(0.1);
+  }
   rx_stream->issue_stream_cmd(stream_cmd);
 
+  start_stats_reporter();
   bool overflows =
       run_stream(rx_stream, time_requested, max_samples, num_requested_samples);
 
   stream_cmd.stream_mode = uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS;
   rx_stream->issue_stream_cmd(stream_cmd);
+  drain_rx_stream(rx_stream);
   std::cerr << "stream stopped" << std::endl;
-  sample_pipeline_stop(overflows);
+  for (size_t i = 0; i < channels.size(); ++i) {
+    get_sample_pipeline(i).stop(overflows);
+  }
+  stop_stats_reporter();
+  std::cerr << "pipeline stopped" << std::endl;
+}
+
+void source_record(const std::string &type, const std::string &file,
+                   const std::string &fft_file, const size_t rate,
+                   const size_t samps_per_buff, const size_t zlevel,
+                   const size_t num_requested_samples,
+                   const double time_requested, const bool use_vkfft,
+                   const size_t nfft, const size_t nfft_overlap,
+                   const size_t nfft_div, const size_t nfft_ds,
+                   const size_t batches, const size_t sample_id) {
+  std::string cpu_format;
+  set_sample_pipeline_types(type, cpu_format);
+  std::vector<double> tone_freqs;
+  if (synthetic) {
+    std::vector<std::string> tone_strs;
+    boost::split(tone_strs, tones, boost::is_any_of(","));
+    for (const auto &tone_str : tone_strs) {
+      if (tone_str.size()) {
+        tone_freqs.push_back(std::stod(tone_str));
+      }
+    }
+  }
+
+  set_sample_pipeline_prealloc_samples(
+      num_requested_samples ? num_requested_samples
+                            : size_t(time_requested * rate));
+  const auto start_time = std::chrono::steady_clock::now();
+  set_sample_pipeline_ddcs(ddc_specs);
+  sample_pipeline_start(file, fft_file, samps_per_buff, zlevel, use_vkfft,
+                        nfft, nfft_overlap, nfft_div, nfft_ds, rate, batches,
+                        sample_id);
+  stop_streaming = false;
+  start_stats_reporter();
+  size_t samples = 0;
+  if (synthetic) {
+    samples = run_synthetic_source(type, tone_freqs, noise, samps_per_buff,
+                                   rate, !unpaced, num_requested_samples,
+                                   time_requested, stop_streaming);
+  } else {
+    samples = run_file_source(replay_file, samps_per_buff, rate, !unpaced,
+                              num_requested_samples, time_requested,
+                              stop_streaming);
+  }
+  sample_pipeline_stop(0);
+  stop_stats_reporter();
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start_time)
+                             .count();
   std::cerr << "pipeline stopped" << std::endl;
+
+  json result;
+  result["samples"] = samples;
+  result["seconds"] = seconds;
+  result["msps"] = samples / seconds / 1e6;
+  result["pipeline_overruns"] = get_pipeline_overruns();
+  result["type"] = type;
+  result["nfft"] = nfft;
+  result["vkfft"] = use_vkfft;
+  result["stats"] = channels_stats_json();
+  std::cout << result << std::endl;
 }
 
 int parse_args(int argc, char *argv[]) {
@@ -224,7 +500,59 @@ int parse_args(int argc, char *argv[]) {
       "duration", po::value<double>(&total_time)->default_value(0),
       "total number of seconds to receive")(
       "zlevel", po::value<size_t>(&zlevel)->default_value(1),
-      "default compression level")("spb",
+      "default compression level")(
+      "zthreads", po::value<size_t>(&zthreads)->default_value(0),
+      "zstd compression threads (if 0, compress on the writer thread)")(
+      "direct_io", "write uncompressed samples with direct I/O")(
+      "numa_node",
+      po::value<std::string>(&numa_node_option)->default_value(""),
+      "allocate buffers on this NUMA node, or the node of this network "
+      "interface (e.g. eth0)")(
+      "rotate_seconds", po::value<double>(&rotate_seconds)->default_value(0),
+      "if > 0, start new output files every n seconds of samples")(
+      "rotate_mb", po::value<size_t>(&rotate_mb)->default_value(0),
+      "if > 0, start new output files every n MB of samples")(
+      "trigger_dbfs", po::value<double>(&trigger_dbfs),
+      "only write samples in bursts, each to its own file, when a sample "
+      "buffer's mean power reaches this many dB relative to full scale")(
+      "trigger_pre_seconds",
+      po::value<double>(&trigger_pre_seconds)->default_value(1),
+      "seconds of samples to write before a burst triggers")(
+      "seekable_frame_kb",
+      po::value<size_t>(&seekable_frame_kb)->default_value(0),
+      "if > 0, write .zst output in the zstd seekable format, in "
+      "independently compressed frames of n KB (with zthreads frames "
+      "compressed in parallel), indexed in a .idx file")(
+      "history_seconds",
+      po::value<double>(&history_seconds)->default_value(0),
+      "keep the last n seconds of samples in memory, written to a snapshot_ "
+      "prefixed file on a {\"snapshot\": n} request (with --json)")(
+      "trigger_hang_seconds",
+      po::value<double>(&trigger_hang_seconds)->default_value(1),
+      "seconds of samples to write after a burst's power falls below "
+      "trigger_dbfs")(
+      "fft_threads", po::value<size_t>(&fft_threads)->default_value(1),
+      "software FFT threads")(
+      "fftshift", "write FFT points with DC in the center bin")(
+      "fft_avg", po::value<std::string>(&fft_avg)->default_value("none"),
+      "average FFT frames (none, mean, max, min or ema)")(
+      "fft_avg_frames", po::value<size_t>(&fft_avg_frames)->default_value(10),
+      "FFT frames per averaged frame")(
+      "fft_encoding",
+      po::value<std::string>(&fft_encoding)->default_value("float32"),
+      "FFT file encoding (float32, float16 or uint8)")(
+      "fft_db_min", po::value<double>(&fft_db_min)->default_value(-100),
+      "dB value of uint8 FFT encoding 0")(
+      "fft_db_max", po::value<double>(&fft_db_max)->default_value(100),
+      "dB value of uint8 FFT encoding 255")(
+      "fft_bin_decimation",
+      po::value<size_t>(&fft_bin_decimation)->default_value(1),
+      "reduce each n adjacent FFT bins to one")(
+      "fft_bin_decimation_mode",
+      po::value<std::string>(&fft_bin_decimation_mode)->default_value("mean"),
+      "FFT bin decimation mode (mean or max)")(
+      "buffer_mb", po::value<size_t>(&buffer_mb)->default_value(0),
+      "sample buffer pool size in MB (if 0, 8 buffers)")("spb",
                                    po::value<size_t>(&spb)->default_value(0),
                                    "samples per buffer (if 0, same as rate)")(
       "rate", po::value<double>(&option_rate)->default_value(2.048e6),
@@ -237,8 +565,15 @@ int parse_args(int argc, char *argv[]) {
       "ant", po::value<std::string>(&ant), "antenna selection")(
       "subdev", po::value<std::string>(&subdev), "subdevice specification")(
       "channel", po::value<size_t>(&channel)->default_value(0),
-      "which channel to use")("bw", po::value<double>(&bw),
-                              "analog frontend filter bandwidth in Hz")(
+      "which channel to use")(
+      "ddc", po::value<std::vector<std::string>>(&ddc_options)->composing(),
+      "also record the sub-band of bandwidth bw Hz at freq Hz from the "
+      "center frequency, decimated, to its own ddc_<freq>_ prefixed file "
+      "(freq,bw; may be repeated)")(
+      "channels", po::value<std::string>(&channels_option)->default_value(""),
+      "comma separated channels to record together (e.g. 0,1), each to "
+      "its own ch<n>_ prefixed files (overrides --channel)")(
+      "bw", po::value<double>(&bw), "analog frontend filter bandwidth in Hz")(
       "ref", po::value<std::string>(&ref)->default_value("internal"),
       "reference source (internal, external, mimo)")(
       "wirefmt", po::value<std::string>(&wirefmt)->default_value("sc16"),
@@ -259,10 +594,37 @@ int parse_args(int argc, char *argv[]) {
       "fft_file", po::value<std::string>(&fft_file)->default_value(""),
       "name of file to write FFT points to (default derive from --file)")(
       "novkfft", "do not use vkFFT (use software FFT)")(
+      "fftw_wisdom",
+      po::value<std::string>(&fftw_wisdom)
+          ->default_value(getenv("HOME") ? std::string(getenv("HOME")) +
+                                               "/.uhd_sample_recorder.wisdom"
+                                         : ""),
+      "file to cache software FFT plans in (empty to disable)")(
+      "vkfft_cache_dir",
+      po::value<std::string>(&vkfft_cache_dir)
+          ->default_value(getenv("HOME") ? std::string(getenv("HOME")) +
+                                               "/.uhd_sample_recorder.vkfft"
+                                         : ""),
+      "directory to cache compiled vkFFT kernels in (empty to disable)")(
       "vkfft_batches", po::value<size_t>(&batches)->default_value(100),
       "vkFFT batches")(
       "vkfft_sample_id", po::value<size_t>(&sample_id)->default_value(0),
-      "vkFFT sample_id")("json", "take parameters from json on stdin");
+      "vkFFT sample_id")("json", "take parameters from json on stdin")(
+      "replay", po::value<std::string>(&replay_file),
+      "replay samples from file (raw, .gz or .zst) instead of a USRP")(
+      "synthetic", "generate synthetic samples instead of using a USRP")(
+      "tones", po::value<std::string>(&tones)->default_value("100e3"),
+      "comma separated synthetic tone offsets in Hz")(
+      "noise", po::value<double>(&noise)->default_value(0.01),
+      "synthetic noise amplitude relative to full scale")(
+      "unpaced", "replay/generate samples as fast as possible, not at --rate")(
+      "stats_interval", po::value<double>(&stats_interval)->default_value(0),
+      "if > 0, report pipeline stats every n seconds while recording (as "
+      "--json status lines and to --prometheus_file)")(
+      "prometheus_file",
+      po::value<std::string>(&prometheus_file)->default_value(""),
+      "file to write pipeline stats to in Prometheus text format (e.g. for "
+      "the node_exporter textfile collector)");
   po::store(po::parse_command_line(argc, argv, desc), vm);
   po::notify(vm);
 
@@ -272,6 +634,10 @@ int parse_args(int argc, char *argv[]) {
   use_json_args = vm.count("json") > 0;
   int_n = vm.count("int-n") > 0;
   skip_lo = vm.count("skip-lo") > 0;
+  synthetic = vm.count("synthetic") > 0;
+  unpaced = vm.count("unpaced") > 0;
+  direct_io = vm.count("direct_io") > 0;
+  fftshift = vm.count("fftshift") > 0;
 
   if (vm.count("help")) {
     std::cerr << boost::format("uhd_sample_recorder: %s") % desc << std::endl;
@@ -291,15 +657,66 @@ int parse_args(int argc, char *argv[]) {
     throw std::runtime_error("nfft_div must be a factor of sample rate");
   }
 
+  check_sample_pipeline_fft(nfft, nfft_overlap, fft_bin_decimation);
+
+  if (fft_bin_decimation_mode != "mean" && fft_bin_decimation_mode != "max") {
+    throw std::runtime_error("Unknown fft_bin_decimation_mode " +
+                             fft_bin_decimation_mode);
+  }
+
+  channels.clear();
+  if (channels_option.size()) {
+    std::vector<std::string> channel_strs;
+    boost::split(channel_strs, channels_option, boost::is_any_of(","));
+    for (const auto &channel_str : channel_strs) {
+      if (channel_str.size()) {
+        channels.push_back(std::stoul(channel_str));
+      }
+    }
+  }
+  if (channels.empty()) {
+    channels.push_back(channel);
+  }
+  if (channels.size() > 1 && (synthetic || replay_file.size())) {
+    throw std::runtime_error("--channels needs a USRP");
+  }
+
+  numa_node = -1;
+  if (numa_node_option.size()) {
+    if (isdigit(numa_node_option[0])) {
+      numa_node = std::stoi(numa_node_option);
+    } else {
+      numa_node = interface_numa_node(numa_node_option);
+      if (numa_node < 0) {
+        std::cerr << "NUMA node of " << numa_node_option << " unknown"
+                  << std::endl;
+      }
+    }
+  }
+
   if (spb == 0) {
     spb = rate;
     std::cerr << "defaulting spb to rate (" << spb << ")" << std::endl;
   }
 
   if (!fft_file.size()) {
-    fft_file = get_prefix_file(file, "fft_");
+    fft_file = prefix_file(file, "fft_");
   }
 
+  ddc_specs.clear();
+  for (const auto &ddc_option : ddc_options) {
+    std::vector<std::string> ddc_strs;
+    boost::split(ddc_strs, ddc_option, boost::is_any_of(","));
+    if (ddc_strs.size() != 2) {
+      throw std::runtime_error("--ddc must be freq,bw");
+    }
+    DDCSpec spec;
+    spec.freq = std::stod(ddc_strs[0]);
+    spec.bw = std::stod(ddc_strs[1]);
+    ddc_specs.push_back(spec);
+  }
+  set_derived_files(file);
+
   if (null) {
     file.clear();
   }
@@ -311,16 +728,85 @@ int parse_args(int argc, char *argv[]) {
   return 0;
 }
 
-void serve_json(uhd::usrp::multi_usrp::sptr usrp) {
+// Write the last seconds (the "snapshot" value) of each channel's history
+// to the request's file, or the snapshot file.
+void take_snapshot(const json &json_args) {
+  json status;
+  try {
+    const double seconds = json_args.value("snapshot", 0.0);
+    std::string file;
+    {
+      std::lock_guard<std::mutex> lock(requests_mutex);
+      file = json_args.value("file", snapshot_file);
+    }
+    json files = json::array();
+    for (size_t i = 0; i < channels.size(); ++i) {
+      files.push_back(get_sample_pipeline(i).snapshot(
+          seconds, channel_file(file, channels[i])));
+    }
+    status["snapshot"] = files;
+  } catch (json::basic_json::type_error &ex) {
+    status["last_error"] = "json parameter type error";
+  }
+  std::lock_guard<std::mutex> lock(stdout_mutex);
+  std::cout << status << std::endl;
+}
+
+void stdin_worker() {
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    json json_args;
+    try {
+      json_args = json::parse(line);
+    } catch (json::parse_error &ex) {
+      // reported when the request is served.
+    }
+    if (json_args.contains("snapshot")) {
+      take_snapshot(json_args);
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(requests_mutex);
+    requests.push_back(line);
+    requests_cv.notify_all();
+  }
+  std::lock_guard<std::mutex> lock(requests_mutex);
+  requests_done = true;
+  requests_cv.notify_all();
+}
+
+bool next_request(std::string &line) {
+  std::unique_lock<std::mutex> lock(requests_mutex);
+  requests_cv.wait(lock, [] { return requests_done || !requests.empty(); });
+  if (requests.empty()) {
+    return false;
+  }
+  line = requests.front();
+  requests.pop_front();
+  return true;
+}
+
+void serve_json(uhd::usrp::multi_usrp::sptr usrp,
+                uhd::rx_streamer::sptr rx_stream) {
   json status, json_args;
   std::string line, last_error;
+  // create the pipelines before stdin_worker can snapshot them.
+  for (size_t i = 0; i < channels.size(); ++i) {
+    get_sample_pipeline(i);
+  }
+  requests_done = false;
+  std::thread stdin_thread(stdin_worker);
   for (;;) {
     status["freq"] = freq;
+    status["pipeline_overruns"] = channels_pipeline_overruns();
+    status["stats"] = channels_stats_json();
     status["last_error"] = last_error;
     last_error.clear();
-    std::cout << status << std::endl;
+    {
+      std::lock_guard<std::mutex> lock(stdout_mutex);
+      std::cout << status << std::endl;
+    }
     json_args.clear();
-    if (!std::getline(std::cin, line)) {
+    if (!next_request(line)) {
       break;
     }
     try {
@@ -330,33 +816,48 @@ void serve_json(uhd::usrp::multi_usrp::sptr usrp) {
       continue;
     }
     try {
-      file = json_args.value("file", file);
+      if (json_args.contains("file")) {
+        file = json_args.value("file", file);
+        set_derived_files(file);
+      }
       fft_file = json_args.value("fft_file", fft_file);
       total_time = json_args.value("duration", total_time);
       freq = json_args.value("freq", freq);
-      nfft = json_args.value("nfft", nfft);
-      nfft_overlap = json_args.value("nfft_overlap", nfft_overlap);
+      const size_t new_nfft = json_args.value("nfft", nfft);
+      const size_t new_nfft_overlap =
+          json_args.value("nfft_overlap", nfft_overlap);
+      check_sample_pipeline_fft(new_nfft, new_nfft_overlap,
+                                fft_bin_decimation);
+      nfft = new_nfft;
+      nfft_overlap = new_nfft_overlap;
     } catch (json::basic_json::type_error &ex) {
       last_error = "json parameter type error";
       continue;
+    } catch (std::runtime_error &ex) {
+      last_error = ex.what();
+      continue;
     }
-    tune(usrp, channel, freq, lo_offset, int_n);
-    if (!skip_lo) {
-      lo_lock(usrp, ref, channel, setup_time);
+    for (size_t channel : channels) {
+      tune(usrp, channel, freq, lo_offset, int_n);
+      if (!skip_lo) {
+        lo_lock(usrp, ref, channel, setup_time);
+      }
     }
-    sample_record(usrp, type, wirefmt, channel, file, fft_file, rate, spb,
-                  zlevel, total_num_samps, total_time, use_vkfft, nfft,
-                  nfft_overlap, nfft_div, nfft_ds, batches, sample_id);
+    sample_record(usrp, rx_stream, type, file, fft_file, rate, spb, zlevel,
+                  total_num_samps, total_time, use_vkfft, nfft, nfft_overlap,
+                  nfft_div, nfft_ds, batches, sample_id);
     last_error = "";
   }
+  stdin_thread.join();
 }
 
-void serve_once(uhd::usrp::multi_usrp::sptr usrp) {
+void serve_once(uhd::usrp::multi_usrp::sptr usrp,
+                uhd::rx_streamer::sptr rx_stream) {
   if (total_num_samps == 0) {
     std::cerr << "^C to stop" << std::endl;
   }
 
-  sample_record(usrp, type, wirefmt, channel, file, fft_file, rate, spb, zlevel,
+  sample_record(usrp, rx_stream, type, file, fft_file, rate, spb, zlevel,
                 total_num_samps, total_time, use_vkfft, nfft, nfft_overlap,
                 nfft_div, nfft_ds, batches, sample_id);
 }
@@ -371,36 +872,45 @@ void init_usrp(uhd::usrp::multi_usrp::sptr usrp) {
   if (vm.count("subdev"))
     usrp->set_rx_subdev_spec(subdev);
 
-  if (vm.count("ant"))
-    usrp->set_rx_antenna(ant, channel);
-
-  std::cerr << boost::format("setting RX rate: %f Msps...") % (rate / 1e6)
-            << std::endl;
-  usrp->set_rx_rate(rate, channel);
-  std::cerr << boost::format("actual RX rate: %f Msps...") %
-                   (usrp->get_rx_rate(channel) / 1e6)
-            << std::endl;
-
-  if (vm.count("gain")) {
-    std::cerr << boost::format("setting RX gain: %f dB...") % gain << std::endl;
-    usrp->set_rx_gain(gain, channel);
-    std::cerr << boost::format("actual RX gain: %f dB...") %
-                     usrp->get_rx_gain(channel)
-              << std::endl;
+  if (channels.size() > 1) {
+    // channels are started together at a device time.
+    usrp->set_time_now(uhd::time_spec_t(0.0));
   }
 
-  if (vm.count("bw")) {
-    std::cerr << boost::format("setting RX bandwidth: %f MHz...") % (bw / 1e6)
+  for (size_t channel : channels) {
+    if (vm.count("ant"))
+      usrp->set_rx_antenna(ant, channel);
+
+    std::cerr << boost::format("setting RX rate: %f Msps...") % (rate / 1e6)
               << std::endl;
-    usrp->set_rx_bandwidth(bw, channel);
-    std::cerr << boost::format("actual RX bandwidth: %f MHz...") %
-                     (usrp->get_rx_bandwidth(channel) / 1e6)
+    usrp->set_rx_rate(rate, channel);
+    std::cerr << boost::format("actual RX rate: %f Msps...") %
+                     (usrp->get_rx_rate(channel) / 1e6)
               << std::endl;
-  }
 
-  tune(usrp, channel, freq, lo_offset, int_n);
-  if (!skip_lo) {
-    lo_lock(usrp, ref, channel, setup_time);
+    if (vm.count("gain")) {
+      std::cerr << boost::format("setting RX gain: %f dB...") % gain
+                << std::endl;
+      usrp->set_rx_gain(gain, channel);
+      std::cerr << boost::format("actual RX gain: %f dB...") %
+                       usrp->get_rx_gain(channel)
+                << std::endl;
+    }
+
+    if (vm.count("bw")) {
+      std::cerr << boost::format("setting RX bandwidth: %f MHz...") %
+                       (bw / 1e6)
+                << std::endl;
+      usrp->set_rx_bandwidth(bw, channel);
+      std::cerr << boost::format("actual RX bandwidth: %f MHz...") %
+                       (usrp->get_rx_bandwidth(channel) / 1e6)
+                << std::endl;
+    }
+
+    tune(usrp, channel, freq, lo_offset, int_n);
+    if (!skip_lo) {
+      lo_lock(usrp, ref, channel, setup_time);
+    }
   }
 
   std::this_thread::sleep_for(
@@ -411,17 +921,50 @@ int UHD_SAFE_MAIN(int argc, char *argv[]) {
   if (parse_args(argc, argv))
     return ~0;
 
+  set_sample_pipeline_zthreads(zthreads);
+  set_sample_pipeline_direct_io(direct_io);
+  set_sample_pipeline_numa_node(numa_node);
+  set_sample_pipeline_buffer_mb(buffer_mb);
+  set_sample_pipeline_fft_threads(fft_threads);
+  set_sample_pipeline_fftshift(fftshift);
+  set_sample_pipeline_fft_avg(fft_avg, fft_avg_frames);
+  set_sample_pipeline_rotate(rotate_seconds, rotate_mb * 1024 * 1024);
+  set_sample_pipeline_history(history_seconds);
+  set_sample_pipeline_seekable_frame_bytes(seekable_frame_kb * 1024);
+  set_sample_pipeline_trigger(vm.count("trigger_dbfs"), trigger_dbfs,
+                              trigger_pre_seconds, trigger_hang_seconds);
+  set_sample_pipeline_fft_encoding(fft_encoding, fft_db_min, fft_db_max,
+                                   fft_bin_decimation,
+                                   fft_bin_decimation_mode == "max");
+  set_sample_pipeline_fftw_wisdom(fftw_wisdom);
+  set_sample_pipeline_vkfft_cache_dir(vkfft_cache_dir);
+
+  if (synthetic || replay_file.size()) {
+    std::signal(SIGINT, &sig_int_handler);
+    source_record(type, file, fft_file, rate, spb, zlevel, total_num_samps,
+                  total_time, use_vkfft, nfft, nfft_overlap, nfft_div, nfft_ds,
+                  batches, sample_id);
+    sample_pipeline_free();
+    return EXIT_SUCCESS;
+  }
+
   std::cerr << boost::format("creating usrp device with: %s...") % uhd_args
             << std::endl;
   uhd::usrp::multi_usrp::sptr usrp = uhd::usrp::multi_usrp::make(uhd_args);
   init_usrp(usrp);
   std::signal(SIGINT, &sig_int_handler);
 
-  if (use_json_args) {
-    serve_json(usrp);
-  } else {
-    serve_once(usrp);
+  {
+    // the streamer is released before usrp.
+    uhd::rx_streamer::sptr rx_stream =
+        get_rx_stream(usrp, type, wirefmt, channels);
+    if (use_json_args) {
+      serve_json(usrp, rx_stream);
+    } else {
+      serve_once(usrp, rx_stream);
+    }
   }
+  sample_pipeline_free();
 
   return EXIT_SUCCESS;
 }
@@ -1,112 +1,507 @@
 #include "vkFFT.h"
 #include "ShaderLang.h"
+#include "glslang_c_interface.h"
 #include "sigpack/sigpack.h"
 #include "utils_VkFFT.h"
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
 
-const uint64_t kVkNumBuf = 1;
+// Batches are transformed through a ring of kVkFFTSlots slots, each with its
+// own device buffer, persistently mapped staging buffer, and pre-recorded
+// command buffer (upload, FFT, download), so the host copies one batch while
+// the GPU transforms another.
+const size_t kVkFFTSlots = 3;
+const uint32_t kVkQueriesPerSlot = 4;
 const uint64_t sample_size = sizeof(std::complex<float>);
+const uint32_t kShaderGroupSize = 256;
+
+// With vkfft_set_power_db(), frames are windowed (optionally converted from
+// sc16/fc32) and reduced to dB by these shaders around the FFT. Both use
+// binding 0 as input, 1 as the window and 2 as output.
+const char kWindowShader[] = R"(
+#version 450
+layout(local_size_x = 256) in;
+layout(std430, binding = 0) readonly buffer In { uint raw[]; };
+layout(std430, binding = 1) readonly buffer Window { float window[]; };
+layout(std430, binding = 2) writeonly buffer Out { vec2 samples[]; };
+layout(push_constant) uniform Params {
+  uint nfft;
+  uint n;
+  uint sc16;
+  float offset_db;
+  uint shift;
+} p;
+
+void main() {
+  for (uint i = gl_GlobalInvocationID.x; i < p.n;
+       i += gl_NumWorkGroups.x * gl_WorkGroupSize.x) {
+    vec2 x;
+    if (p.sc16 != 0) {
+      int iq = int(raw[i]);
+      x = vec2(bitfieldExtract(iq, 0, 16), bitfieldExtract(iq, 16, 16));
+    } else {
+      x = uintBitsToFloat(uvec2(raw[i * 2], raw[i * 2 + 1]));
+    }
+    samples[i] = x * window[i % p.nfft];
+  }
+}
+)";
+
+const char kPowerDbShader[] = R"(
+#version 450
+layout(local_size_x = 256) in;
+layout(std430, binding = 0) readonly buffer In { vec2 bins[]; };
+layout(std430, binding = 2) writeonly buffer Out { float db[]; };
+layout(push_constant) uniform Params {
+  uint nfft;
+  uint n;
+  uint sc16;
+  float offset_db;
+  uint shift;
+} p;
+
+void main() {
+  for (uint i = gl_GlobalInvocationID.x; i < p.n;
+       i += gl_NumWorkGroups.x * gl_WorkGroupSize.x) {
+    vec2 x = bins[i];
+    uint bin = i % p.nfft;
+    // the smallest normal float, so 0 is about -380 dB rather than -inf.
+    db[i - bin + (bin + p.shift) % p.nfft] =
+        log2(max(dot(x, x), 1.17549435e-38)) * 3.01029996 + p.offset_db;
+  }
+}
+)";
+
+struct ShaderParams {
+  uint32_t nfft;
+  uint32_t n;
+  uint32_t sc16;
+  float offset_db;
+  uint32_t shift;
+};
+
+struct VkFFTSlot {
+  VkFFTApplication app;
+  VkBuffer buffer;
+  VkDeviceMemory bufferMemory;
+  // raw frames in, and dB points out, with vkfft_set_power_db().
+  VkBuffer rawBuffer;
+  VkDeviceMemory rawBufferMemory;
+  VkBuffer dbBuffer;
+  VkDeviceMemory dbBufferMemory;
+  VkDescriptorSet windowSet;
+  VkDescriptorSet powerDbSet;
+  VkBuffer stagingBuffer;
+  VkDeviceMemory stagingBufferMemory;
+  char *staging_p;
+  VkCommandBuffer commandBuffer;
+  VkFence fence;
+  // destination of the batch in flight, copied from staging when done.
+  char *out_p;
+  size_t out_size;
+  bool in_flight;
+};
+
 static VkGPU vkGPU = {};
 static VkFFTConfiguration vkConfiguration = {};
-static VkDeviceMemory *vkBufferDeviceMemory = NULL;
-static VkFFTApplication vkApp = {};
-static VkFFTLaunchParams vkLaunchParams = {};
-static VkBuffer stagingBuffer = {0};
-static VkDeviceMemory stagingBufferMemory = {0};
+static VkFFTSlot vkSlots[kVkFFTSlots] = {};
+static VkQueryPool vkQueryPool = VK_NULL_HANDLE;
 static uint64_t fftBufferSize = 0;
 static uint64_t stagingBufferSize = 0;
+static VkBuffer windowBuffer = VK_NULL_HANDLE;
+static VkDeviceMemory windowBufferMemory = VK_NULL_HANDLE;
+static VkDescriptorSetLayout shaderSetLayout = VK_NULL_HANDLE;
+static VkPipelineLayout shaderLayout = VK_NULL_HANDLE;
+static VkDescriptorPool shaderPool = VK_NULL_HANDLE;
+static VkPipeline windowPipeline = VK_NULL_HANDLE;
+static VkPipeline powerDbPipeline = VK_NULL_HANDLE;
+// current vkfft_set_power_db() settings, recorded in the command buffers.
+static bool vkPowerDb = false, vkFFTShift = false;
+static size_t vkRawSampSize = 0;
+static float vkWindowSum = 0;
+// compiled kernels loaded from the cache, which must outlive initializeVkFFT.
+static std::vector<char> vkAppString;
+// glslang_initialize_process() has been called, by init_vkfft().
+static bool vkCompilerInitialized = false;
 
-VkFFTResult _setupCopy(VkCommandBuffer &commandBuffer,
-                       VkBufferCopy &copyRegion) {
-  VkResult res = VK_SUCCESS;
-  copyRegion.srcOffset = 0;
-  copyRegion.dstOffset = 0;
-  copyRegion.size = stagingBufferSize;
+// Per batch timings since the last log_vkfft_timings(). GPU stage times are
+// from timestamp queries, when the device supports them.
+static size_t vkTimedBatches = 0;
+static double vkUploadNs = 0, vkFFTNs = 0, vkDownloadNs = 0, vkWaitNs = 0;
+
+void shader_barrier(VkCommandBuffer commandBuffer, VkFlags srcStage,
+                    VkFlags srcAccess, VkFlags dstStage, VkFlags dstAccess) {
+  VkMemoryBarrier barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask = srcAccess;
+  barrier.dstAccessMask = dstAccess;
+  vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0, 1, &barrier, 0,
+                       NULL, 0, NULL);
+}
+
+void dispatch_shader(VkCommandBuffer commandBuffer, VkPipeline pipeline,
+                     VkDescriptorSet set, const ShaderParams &params) {
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          shaderLayout, 0, 1, &set, 0, NULL);
+  vkCmdPushConstants(commandBuffer, shaderLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+                     0, sizeof(params), &params);
+  // shaders loop over the remainder, if the group count limit is reached.
+  const uint32_t groups = std::min(
+      (params.n + kShaderGroupSize - 1) / kShaderGroupSize,
+      vkGPU.physicalDeviceProperties.limits.maxComputeWorkGroupCount[0]);
+  vkCmdDispatch(commandBuffer, groups, 1, 1);
+}
+
+VkFFTResult record_vkfft_slot(size_t slot) {
+  VkFFTSlot &s = vkSlots[slot];
   VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
       VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
   commandBufferAllocateInfo.commandPool = vkGPU.commandPool;
   commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
   commandBufferAllocateInfo.commandBufferCount = 1;
-  res = vkAllocateCommandBuffers(vkGPU.device, &commandBufferAllocateInfo,
-                                 &commandBuffer);
+  VkResult res = vkAllocateCommandBuffers(
+      vkGPU.device, &commandBufferAllocateInfo, &s.commandBuffer);
   if (res != VK_SUCCESS)
     return VKFFT_ERROR_FAILED_TO_ALLOCATE_COMMAND_BUFFERS;
+  // no ONE_TIME_SUBMIT, the command buffer is resubmitted for every batch.
   VkCommandBufferBeginInfo commandBufferBeginInfo = {
       VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
-  commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-  res = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
+  res = vkBeginCommandBuffer(s.commandBuffer, &commandBufferBeginInfo);
   if (res != VK_SUCCESS)
     return VKFFT_ERROR_FAILED_TO_BEGIN_COMMAND_BUFFER;
-  return VKFFT_SUCCESS;
-}
 
-VkFFTResult _runCopy(VkCommandBuffer &commandBuffer) {
-  VkResult res = vkEndCommandBuffer(commandBuffer);
+  const uint64_t nfft = vkConfiguration.size[0];
+  ShaderParams params = {};
+  params.nfft = nfft;
+  params.n = nfft * vkConfiguration.numberBatches;
+  params.sc16 = vkRawSampSize == sizeof(std::complex<short>);
+  params.offset_db = -3.01029996f * log2f(vkWindowSum);
+  params.shift = vkFFTShift ? nfft / 2 : 0;
+  const bool raw = vkPowerDb && vkRawSampSize;
+  const uint32_t query = slot * kVkQueriesPerSlot;
+  if (vkQueryPool) {
+    vkCmdResetQueryPool(s.commandBuffer, vkQueryPool, query,
+                        kVkQueriesPerSlot);
+    vkCmdWriteTimestamp(s.commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        vkQueryPool, query);
+  }
+  VkBufferCopy copyRegion = {0};
+  copyRegion.size = raw ? params.n * vkRawSampSize : stagingBufferSize;
+  vkCmdCopyBuffer(s.commandBuffer, s.stagingBuffer,
+                  raw ? s.rawBuffer : s.buffer, 1, &copyRegion);
+  shader_barrier(s.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                 VK_ACCESS_TRANSFER_WRITE_BIT,
+                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                 VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+  if (raw) {
+    dispatch_shader(s.commandBuffer, windowPipeline, s.windowSet, params);
+    shader_barrier(s.commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                   VK_ACCESS_SHADER_WRITE_BIT,
+                   VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                   VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+  }
+  if (vkQueryPool) {
+    vkCmdWriteTimestamp(s.commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        vkQueryPool, query + 1);
+  }
+
+  VkFFTLaunchParams launchParams = {};
+  launchParams.commandBuffer = &s.commandBuffer;
+  launchParams.buffer = &s.buffer;
+  VkFFTResult resFFT = VkFFTAppend(&s.app, -1, &launchParams);
+  if (resFFT != VKFFT_SUCCESS)
+    return resFFT;
+  VkBuffer outBuffer = s.buffer;
+  if (vkPowerDb) {
+    shader_barrier(s.commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                   VK_ACCESS_SHADER_WRITE_BIT,
+                   VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                   VK_ACCESS_SHADER_READ_BIT);
+    dispatch_shader(s.commandBuffer, powerDbPipeline, s.powerDbSet, params);
+    outBuffer = s.dbBuffer;
+    copyRegion.size = params.n * sizeof(float);
+  } else {
+    copyRegion.size = stagingBufferSize;
+  }
+  shader_barrier(s.commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                 VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                 VK_ACCESS_TRANSFER_READ_BIT);
+  if (vkQueryPool) {
+    vkCmdWriteTimestamp(s.commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        vkQueryPool, query + 2);
+  }
+  vkCmdCopyBuffer(s.commandBuffer, outBuffer, s.stagingBuffer, 1,
+                  &copyRegion);
+  shader_barrier(s.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                 VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                 VK_ACCESS_HOST_READ_BIT);
+  if (vkQueryPool) {
+    vkCmdWriteTimestamp(s.commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        vkQueryPool, query + 3);
+  }
+  res = vkEndCommandBuffer(s.commandBuffer);
   if (res != VK_SUCCESS)
     return VKFFT_ERROR_FAILED_TO_END_COMMAND_BUFFER;
+  return VKFFT_SUCCESS;
+}
+
+VkFFTResult submit_vkfft_slot(VkFFTSlot &s) {
   VkSubmitInfo submitInfo = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
   submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &commandBuffer;
-  res = vkQueueSubmit(vkGPU.queue, 1, &submitInfo, vkGPU.fence);
-  if (res != VK_SUCCESS)
+  submitInfo.pCommandBuffers = &s.commandBuffer;
+  if (vkQueueSubmit(vkGPU.queue, 1, &submitInfo, s.fence) != VK_SUCCESS)
     return VKFFT_ERROR_FAILED_TO_SUBMIT_QUEUE;
-  res = vkWaitForFences(vkGPU.device, 1, &vkGPU.fence, VK_TRUE, 100000000000);
+  s.in_flight = true;
+  return VKFFT_SUCCESS;
+}
+
+// Wait for the slot's batch, if any, and copy it out.
+VkFFTResult finish_vkfft_slot(size_t slot) {
+  VkFFTSlot &s = vkSlots[slot];
+  if (!s.in_flight) {
+    return VKFFT_SUCCESS;
+  }
+  s.in_flight = false;
+  const auto wait_start = std::chrono::steady_clock::now();
+  VkResult res =
+      vkWaitForFences(vkGPU.device, 1, &s.fence, VK_TRUE, 100000000000);
   if (res != VK_SUCCESS)
     return VKFFT_ERROR_FAILED_TO_WAIT_FOR_FENCES;
-  res = vkResetFences(vkGPU.device, 1, &vkGPU.fence);
+  vkWaitNs += std::chrono::duration<double, std::nano>(
+                  std::chrono::steady_clock::now() - wait_start)
+                  .count();
+  res = vkResetFences(vkGPU.device, 1, &s.fence);
   if (res != VK_SUCCESS)
     return VKFFT_ERROR_FAILED_TO_RESET_FENCES;
-  vkFreeCommandBuffers(vkGPU.device, vkGPU.commandPool, 1, &commandBuffer);
+  memcpy(s.out_p, s.staging_p, s.out_size);
+  ++vkTimedBatches;
+  if (vkQueryPool) {
+    uint64_t timestamps[kVkQueriesPerSlot];
+    if (vkGetQueryPoolResults(vkGPU.device, vkQueryPool,
+                              slot * kVkQueriesPerSlot, kVkQueriesPerSlot,
+                              sizeof(timestamps), timestamps,
+                              sizeof(timestamps[0]),
+                              VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+      const double period =
+          vkGPU.physicalDeviceProperties.limits.timestampPeriod;
+      vkUploadNs += (timestamps[1] - timestamps[0]) * period;
+      vkFFTNs += (timestamps[2] - timestamps[1]) * period;
+      vkDownloadNs += (timestamps[3] - timestamps[2]) * period;
+    }
+  }
   return VKFFT_SUCCESS;
 }
 
-VkFFTResult _transferDataFromCPU(char *cpu_arr, std::size_t transferSize) {
-  VkResult res = VK_SUCCESS;
-  VkBuffer *buffer = &vkConfiguration.buffer[0];
-  char *data;
-  res = vkMapMemory(vkGPU.device, stagingBufferMemory, 0, transferSize, 0,
-                    (void **)&data);
-  if (res != VK_SUCCESS)
-    return VKFFT_ERROR_MALLOC_FAILED;
-  memcpy(data, cpu_arr, transferSize);
-  vkUnmapMemory(vkGPU.device, stagingBufferMemory);
-  VkCommandBuffer commandBuffer = {0};
-  VkBufferCopy copyRegion = {0};
-  VkFFTResult setup_res = _setupCopy(commandBuffer, copyRegion);
-  if (setup_res != VKFFT_SUCCESS) {
-    return setup_res;
+void log_vkfft_timings() {
+  if (!vkTimedBatches) {
+    return;
   }
-  vkCmdCopyBuffer(commandBuffer, stagingBuffer, buffer[0], 1, &copyRegion);
-  return _runCopy(commandBuffer);
+  const double us = 1e3 * vkTimedBatches;
+  std::cerr << "vkFFT " << vkTimedBatches << " batches, per batch: ";
+  if (vkQueryPool) {
+    std::cerr << "upload " << vkUploadNs / us << "us, FFT " << vkFFTNs / us
+              << "us, download " << vkDownloadNs / us << "us, ";
+  }
+  std::cerr << "host wait " << vkWaitNs / us << "us" << std::endl;
+  vkTimedBatches = 0;
+  vkUploadNs = vkFFTNs = vkDownloadNs = vkWaitNs = 0;
 }
 
-VkFFTResult _transferDataToCPU(char *cpu_arr, std::size_t transferSize) {
-  // a function that transfers data from the GPU to the CPU using staging
-  // buffer, because the GPU memory is not host-coherent
-  VkResult res = VK_SUCCESS;
-  VkBuffer *buffer = &vkConfiguration.buffer[0];
-  VkCommandBuffer commandBuffer = {0};
-  VkBufferCopy copyRegion = {0};
-  VkFFTResult setup_res = _setupCopy(commandBuffer, copyRegion);
-  if (setup_res != VKFFT_SUCCESS) {
-    return setup_res;
-  }
-  vkCmdCopyBuffer(commandBuffer, buffer[0], stagingBuffer, 1, &copyRegion);
-  VkFFTResult copy_res = _runCopy(commandBuffer);
-  if (copy_res != VKFFT_SUCCESS) {
-    return copy_res;
-  }
-  char *data;
-  res = vkMapMemory(vkGPU.device, stagingBufferMemory, 0, transferSize, 0,
-                    (void **)&data);
+std::vector<uint32_t> compile_shader(const char *code) {
+  // only the compute limits matter to these shaders.
+  glslang_resource_t resource = {};
+  resource.max_compute_work_group_count_x = 65535;
+  resource.max_compute_work_group_count_y = 65535;
+  resource.max_compute_work_group_count_z = 65535;
+  resource.max_compute_work_group_size_x = 1024;
+  resource.max_compute_work_group_size_y = 1024;
+  resource.max_compute_work_group_size_z = 64;
+  glslang_input_t input = {};
+  input.language = GLSLANG_SOURCE_GLSL;
+  input.stage = GLSLANG_STAGE_COMPUTE;
+  input.client = GLSLANG_CLIENT_VULKAN;
+  input.client_version = GLSLANG_TARGET_VULKAN_1_0;
+  input.target_language = GLSLANG_TARGET_SPV;
+  input.target_language_version = GLSLANG_TARGET_SPV_1_0;
+  input.code = code;
+  input.default_version = 450;
+  input.default_profile = GLSLANG_NO_PROFILE;
+  input.messages = GLSLANG_MSG_DEFAULT_BIT;
+  input.resource = &resource;
+  std::vector<uint32_t> spirv;
+  glslang_shader_t *shader = glslang_shader_create(&input);
+  glslang_program_t *program = glslang_program_create();
+  if (!glslang_shader_preprocess(shader, &input) ||
+      !glslang_shader_parse(shader, &input)) {
+    std::cerr << "cannot compile shader: "
+              << glslang_shader_get_info_log(shader) << std::endl;
+  } else {
+    glslang_program_add_shader(program, shader);
+    if (!glslang_program_link(program, GLSLANG_MSG_SPV_RULES_BIT |
+                                           GLSLANG_MSG_VULKAN_RULES_BIT)) {
+      std::cerr << "cannot link shader: "
+                << glslang_program_get_info_log(program) << std::endl;
+    } else {
+      glslang_program_SPIRV_generate(program, GLSLANG_STAGE_COMPUTE);
+      const uint32_t *spirv_p = glslang_program_SPIRV_get_ptr(program);
+      spirv.assign(spirv_p, spirv_p + glslang_program_SPIRV_get_size(program));
+    }
+  }
+  glslang_program_delete(program);
+  glslang_shader_delete(shader);
+  return spirv;
+}
+
+VkFFTResult create_shader_pipeline(const char *code, VkPipeline *pipeline) {
+  const std::vector<uint32_t> spirv = compile_shader(code);
+  if (spirv.empty())
+    return VKFFT_ERROR_FAILED_SHADER_PARSE;
+  VkShaderModuleCreateInfo shaderModuleCreateInfo = {
+      VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO};
+  shaderModuleCreateInfo.codeSize = spirv.size() * sizeof(uint32_t);
+  shaderModuleCreateInfo.pCode = spirv.data();
+  VkShaderModule shaderModule;
+  if (vkCreateShaderModule(vkGPU.device, &shaderModuleCreateInfo, NULL,
+                           &shaderModule) != VK_SUCCESS)
+    return VKFFT_ERROR_FAILED_TO_CREATE_SHADER_MODULE;
+  VkComputePipelineCreateInfo pipelineCreateInfo = {
+      VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO};
+  pipelineCreateInfo.stage.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipelineCreateInfo.stage.module = shaderModule;
+  pipelineCreateInfo.stage.pName = "main";
+  pipelineCreateInfo.layout = shaderLayout;
+  VkResult res = vkCreateComputePipelines(
+      vkGPU.device, VK_NULL_HANDLE, 1, &pipelineCreateInfo, NULL, pipeline);
+  vkDestroyShaderModule(vkGPU.device, shaderModule, NULL);
   if (res != VK_SUCCESS)
-    return VKFFT_ERROR_MALLOC_FAILED;
-  memcpy(cpu_arr, data, transferSize);
-  vkUnmapMemory(vkGPU.device, stagingBufferMemory);
+    return VKFFT_ERROR_FAILED_TO_CREATE_PIPELINE;
   return VKFFT_SUCCESS;
 }
 
-int64_t init_vkfft(std::size_t batches, std::size_t nfft,
-                   std::size_t sample_id) {
+VkFFTResult init_shaders() {
+  VkDescriptorSetLayoutBinding bindings[3] = {};
+  for (uint32_t i = 0; i < 3; ++i) {
+    bindings[i].binding = i;
+    bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[i].descriptorCount = 1;
+    bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+  VkDescriptorSetLayoutCreateInfo setLayoutCreateInfo = {
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO};
+  setLayoutCreateInfo.bindingCount = 3;
+  setLayoutCreateInfo.pBindings = bindings;
+  if (vkCreateDescriptorSetLayout(vkGPU.device, &setLayoutCreateInfo, NULL,
+                                  &shaderSetLayout) != VK_SUCCESS)
+    return VKFFT_ERROR_FAILED_TO_CREATE_DESCRIPTOR_SET_LAYOUT;
+  VkPushConstantRange pushConstantRange = {VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                                           sizeof(ShaderParams)};
+  VkPipelineLayoutCreateInfo layoutCreateInfo = {
+      VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
+  layoutCreateInfo.setLayoutCount = 1;
+  layoutCreateInfo.pSetLayouts = &shaderSetLayout;
+  layoutCreateInfo.pushConstantRangeCount = 1;
+  layoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+  if (vkCreatePipelineLayout(vkGPU.device, &layoutCreateInfo, NULL,
+                             &shaderLayout) != VK_SUCCESS)
+    return VKFFT_ERROR_FAILED_TO_CREATE_PIPELINE_LAYOUT;
+  // a window and a power/dB descriptor set per slot.
+  VkDescriptorPoolSize poolSize = {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                   3 * 2 * kVkFFTSlots};
+  VkDescriptorPoolCreateInfo poolCreateInfo = {
+      VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO};
+  poolCreateInfo.maxSets = 2 * kVkFFTSlots;
+  poolCreateInfo.poolSizeCount = 1;
+  poolCreateInfo.pPoolSizes = &poolSize;
+  if (vkCreateDescriptorPool(vkGPU.device, &poolCreateInfo, NULL,
+                             &shaderPool) != VK_SUCCESS)
+    return VKFFT_ERROR_FAILED_TO_CREATE_DESCRIPTOR_POOL;
+  VkFFTResult resFFT = create_shader_pipeline(kWindowShader, &windowPipeline);
+  if (resFFT != VKFFT_SUCCESS)
+    return resFFT;
+  return create_shader_pipeline(kPowerDbShader, &powerDbPipeline);
+}
+
+VkFFTResult init_shader_set(VkDescriptorSet *set, VkBuffer in,
+                            uint64_t in_size, VkBuffer out,
+                            uint64_t out_size) {
+  VkDescriptorSetAllocateInfo allocateInfo = {
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO};
+  allocateInfo.descriptorPool = shaderPool;
+  allocateInfo.descriptorSetCount = 1;
+  allocateInfo.pSetLayouts = &shaderSetLayout;
+  if (vkAllocateDescriptorSets(vkGPU.device, &allocateInfo, set) !=
+      VK_SUCCESS)
+    return VKFFT_ERROR_FAILED_TO_ALLOCATE_DESCRIPTOR_SETS;
+  VkDescriptorBufferInfo bufferInfos[3] = {
+      {in, 0, in_size},
+      {windowBuffer, 0, vkConfiguration.size[0] * sizeof(float)},
+      {out, 0, out_size}};
+  VkWriteDescriptorSet writes[3] = {};
+  for (uint32_t i = 0; i < 3; ++i) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = *set;
+    writes[i].dstBinding = i;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[i].pBufferInfo = &bufferInfos[i];
+  }
+  vkUpdateDescriptorSets(vkGPU.device, 3, writes, 0, NULL);
+  return VKFFT_SUCCESS;
+}
+
+// Cached kernels are specific to the device and driver (identified by the
+// pipeline cache UUID), VkFFT version, and FFT parameters.
+std::string vkfft_cache_file(const std::string &cache_dir, std::size_t batches,
+                             std::size_t nfft) {
+  std::string uuid;
+  char hex[3];
+  for (uint8_t byte : vkGPU.physicalDeviceProperties.pipelineCacheUUID) {
+    snprintf(hex, sizeof(hex), "%02x", byte);
+    uuid += hex;
+  }
+  return cache_dir + "/vkfft_" + uuid + "_" +
+         std::to_string(VkFFTGetVersion()) + "_" + std::to_string(nfft) + "_" +
+         std::to_string(batches) + ".bin";
+}
+
+bool load_vkfft_cache(const std::string &cache_file) {
+  std::ifstream cache(cache_file, std::ios::binary);
+  if (!cache) {
+    return false;
+  }
+  vkAppString.assign(std::istreambuf_iterator<char>(cache),
+                     std::istreambuf_iterator<char>());
+  return !vkAppString.empty();
+}
+
+void save_vkfft_cache(const std::string &cache_file) {
+  if (vkAppString.empty()) {
+    return;
+  }
+  boost::filesystem::path cache_path(cache_file);
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(cache_path.parent_path(), ec);
+  // write and rename, so concurrent starts never load a partial cache.
+  const std::string tmp_file = cache_file + ".tmp";
+  {
+    std::ofstream cache(tmp_file, std::ios::binary);
+    cache.write(vkAppString.data(), vkAppString.size());
+    if (!cache) {
+      std::cerr << "cannot write vkFFT cache " << tmp_file << std::endl;
+      return;
+    }
+  }
+  boost::filesystem::rename(tmp_file, cache_file, ec);
+}
+
+int64_t init_vkfft(std::size_t batches, std::size_t nfft, std::size_t sample_id,
+                   const std::string &cache_dir) {
+  const auto start_time = std::chrono::steady_clock::now();
   vkGPU.enableValidationLayers = 0;
 
   VkResult res = VK_SUCCESS;
@@ -147,6 +542,7 @@ int64_t init_vkfft(std::size_t batches, std::size_t nfft,
                                       &vkGPU.physicalDeviceMemoryProperties);
 
   glslang_initialize_process(); // compiler can be initialized before VkFFT
+  vkCompilerInitialized = true;
 
   vkConfiguration.FFTdim = 1;
   vkConfiguration.size[0] = nfft;
@@ -160,97 +556,293 @@ int64_t init_vkfft(std::size_t batches, std::size_t nfft,
   vkConfiguration.isCompilerInitialized = true;
   vkConfiguration.doublePrecision = false;
   vkConfiguration.numberBatches = batches;
-  fftBufferSize = nfft * sample_size;
-  stagingBufferSize = fftBufferSize * vkConfiguration.numberBatches;
+  stagingBufferSize = nfft * sample_size * vkConfiguration.numberBatches;
+  fftBufferSize = stagingBufferSize;
 
   std::cerr << "using vkFFT batch size " << vkConfiguration.numberBatches
             << " on " << vkGPU.physicalDeviceProperties.deviceName << std::endl;
 
-  vkConfiguration.bufferSize =
-      (uint64_t *)aligned_alloc(sizeof(uint64_t), sizeof(uint64_t) * kVkNumBuf);
-  if (!vkConfiguration.bufferSize)
-    return VKFFT_ERROR_MALLOC_FAILED;
+  vkConfiguration.bufferSize = &fftBufferSize;
+  vkConfiguration.bufferNum = 1;
 
-  const size_t buffer_size_f =
-      vkConfiguration.size[0] * vkConfiguration.size[1] *
-      vkConfiguration.size[2] * vkConfiguration.numberBatches / kVkNumBuf;
-  for (uint64_t i = 0; i < kVkNumBuf; ++i) {
-    vkConfiguration.bufferSize[i] = (uint64_t)sample_size * buffer_size_f;
+  if (vkGPU.physicalDeviceProperties.limits.timestampComputeAndGraphics) {
+    VkQueryPoolCreateInfo queryPoolCreateInfo = {
+        VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+    queryPoolCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolCreateInfo.queryCount = kVkFFTSlots * kVkQueriesPerSlot;
+    if (vkCreateQueryPool(vkGPU.device, &queryPoolCreateInfo, NULL,
+                          &vkQueryPool) != VK_SUCCESS) {
+      vkQueryPool = VK_NULL_HANDLE;
+    }
   }
-
-  vkConfiguration.bufferNum = kVkNumBuf;
-
-  vkConfiguration.buffer =
-      (VkBuffer *)aligned_alloc(sample_size, kVkNumBuf * sizeof(VkBuffer));
-  if (!vkConfiguration.buffer)
-    return VKFFT_ERROR_MALLOC_FAILED;
-  vkBufferDeviceMemory = (VkDeviceMemory *)aligned_alloc(
-      sample_size, kVkNumBuf * sizeof(VkDeviceMemory));
-  if (!vkBufferDeviceMemory)
+  VkFFTResult resFFT = allocateBuffer(
+      &vkGPU, &windowBuffer, &windowBufferMemory,
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+      nfft * sizeof(float));
+  if (resFFT != VKFFT_SUCCESS)
     return VKFFT_ERROR_MALLOC_FAILED;
+  resFFT = init_shaders();
+  if (resFFT != VKFFT_SUCCESS)
+    return resFFT;
+  // complex output until vkfft_set_power_db().
+  vkPowerDb = false;
+  vkFFTShift = false;
+  vkRawSampSize = 0;
+  vkWindowSum = 1;
 
-  for (uint64_t i = 0; i < kVkNumBuf; ++i) {
-    vkConfiguration.buffer[i] = {};
-    vkBufferDeviceMemory[i] = {};
-    VkFFTResult resFFT = allocateBuffer(
-        &vkGPU, &vkConfiguration.buffer[i], &vkBufferDeviceMemory[i],
+  std::string cache_file;
+  bool cached = false;
+  if (cache_dir.size()) {
+    cache_file = vkfft_cache_file(cache_dir, batches, nfft);
+    cached = load_vkfft_cache(cache_file);
+  }
+  for (size_t slot = 0; slot < kVkFFTSlots; ++slot) {
+    VkFFTSlot &s = vkSlots[slot];
+    s = {};
+    resFFT = allocateBuffer(
+        &vkGPU, &s.buffer, &s.bufferMemory,
         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
             VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-        VK_MEMORY_HEAP_DEVICE_LOCAL_BIT, vkConfiguration.bufferSize[i]);
+        VK_MEMORY_HEAP_DEVICE_LOCAL_BIT, fftBufferSize);
     if (resFFT != VKFFT_SUCCESS)
       return VKFFT_ERROR_MALLOC_FAILED;
-  }
-
-  vkLaunchParams.buffer = vkConfiguration.buffer;
-
-  VkFFTResult resFFT = initializeVkFFT(&vkApp, vkConfiguration);
-  if (resFFT != VKFFT_SUCCESS)
-    return resFFT;
+    // raw frames are at most complex float, as the FFT buffer.
+    resFFT = allocateBuffer(
+        &vkGPU, &s.rawBuffer, &s.rawBufferMemory,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_HEAP_DEVICE_LOCAL_BIT, fftBufferSize);
+    if (resFFT != VKFFT_SUCCESS)
+      return VKFFT_ERROR_MALLOC_FAILED;
+    resFFT = allocateBuffer(
+        &vkGPU, &s.dbBuffer, &s.dbBufferMemory,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_HEAP_DEVICE_LOCAL_BIT, fftBufferSize / 2);
+    if (resFFT != VKFFT_SUCCESS)
+      return VKFFT_ERROR_MALLOC_FAILED;
+    resFFT = init_shader_set(&s.windowSet, s.rawBuffer, fftBufferSize,
+                             s.buffer, fftBufferSize);
+    if (resFFT != VKFFT_SUCCESS)
+      return resFFT;
+    resFFT = init_shader_set(&s.powerDbSet, s.buffer, fftBufferSize,
+                             s.dbBuffer, fftBufferSize / 2);
+    if (resFFT != VKFFT_SUCCESS)
+      return resFFT;
+    // host cached staging is much faster to read back, where available.
+    const VkBufferUsageFlags stagingUsage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                            VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    resFFT = allocateBuffer(&vkGPU, &s.stagingBuffer, &s.stagingBufferMemory,
+                            stagingUsage,
+                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+                                VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+                            stagingBufferSize);
+    if (resFFT != VKFFT_SUCCESS) {
+      vkDestroyBuffer(vkGPU.device, s.stagingBuffer, NULL);
+      resFFT = allocateBuffer(&vkGPU, &s.stagingBuffer, &s.stagingBufferMemory,
+                              stagingUsage,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                              stagingBufferSize);
+    }
+    if (resFFT != VKFFT_SUCCESS)
+      return VKFFT_ERROR_MALLOC_FAILED;
+    res = vkMapMemory(vkGPU.device, s.stagingBufferMemory, 0,
+                      stagingBufferSize, 0, (void **)&s.staging_p);
+    if (res != VK_SUCCESS)
+      return VKFFT_ERROR_MALLOC_FAILED;
+    VkFenceCreateInfo fenceCreateInfo = {VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+    res = vkCreateFence(vkGPU.device, &fenceCreateInfo, NULL, &s.fence);
+    if (res != VK_SUCCESS)
+      return VKFFT_ERROR_FAILED_TO_CREATE_FENCE;
 
-  resFFT = allocateBuffer(&vkGPU, &stagingBuffer, &stagingBufferMemory,
-                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
-                              VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
-                              VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                          stagingBufferSize);
-  if (resFFT != VKFFT_SUCCESS)
-    return VKFFT_ERROR_MALLOC_FAILED;
+    // Each slot needs its own application, as the application's descriptors
+    // bind the buffer. Slots after the first load the first's kernels.
+    vkConfiguration.buffer = &s.buffer;
+    vkConfiguration.loadApplicationFromString = cached;
+    vkConfiguration.loadApplicationString = cached ? vkAppString.data() : NULL;
+    vkConfiguration.saveApplicationToString = !cached;
+    resFFT = initializeVkFFT(&s.app, vkConfiguration);
+    if (slot == 0 && cached && resFFT != VKFFT_SUCCESS) {
+      std::cerr << "ignoring invalid vkFFT cache " << cache_file << std::endl;
+      deleteVkFFT(&s.app);
+      s.app = {};
+      cached = false;
+      vkConfiguration.loadApplicationFromString = 0;
+      vkConfiguration.loadApplicationString = NULL;
+      vkConfiguration.saveApplicationToString = 1;
+      resFFT = initializeVkFFT(&s.app, vkConfiguration);
+    }
+    if (resFFT != VKFFT_SUCCESS)
+      return resFFT;
+    if (slot == 0) {
+      if (cached) {
+        std::cerr << "loaded vkFFT kernels from " << cache_file << std::endl;
+      } else {
+        const char *app_p = (const char *)s.app.saveApplicationString;
+        vkAppString.assign(app_p, app_p + s.app.applicationStringSize);
+        if (cache_file.size()) {
+          save_vkfft_cache(cache_file);
+        }
+        cached = !vkAppString.empty();
+      }
+    }
+    resFFT = record_vkfft_slot(slot);
+    if (resFFT != VKFFT_SUCCESS)
+      return resFFT;
+  }
+  vkAppString.clear();
 
+  std::cerr << "vkFFT initialized in "
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                             start_time)
+                   .count()
+            << "s" << std::endl;
   return VKFFT_SUCCESS;
 }
 
 void free_vkfft() {
-  vkDestroyBuffer(vkGPU.device, stagingBuffer, NULL);
-  vkFreeMemory(vkGPU.device, stagingBufferMemory, NULL);
-  for (uint64_t i = 0; i < kVkNumBuf; i++) {
-    vkDestroyBuffer(vkGPU.device, vkConfiguration.buffer[i], NULL);
-    vkFreeMemory(vkGPU.device, vkBufferDeviceMemory[i], NULL);
-  }
-  free(vkConfiguration.buffer);
-  free(vkBufferDeviceMemory);
-  free(vkConfiguration.bufferSize);
-  deleteVkFFT(&vkApp);
-  vkDestroyFence(vkGPU.device, vkGPU.fence, NULL);
-  vkDestroyCommandPool(vkGPU.device, vkGPU.commandPool, NULL);
-  vkDestroyDevice(vkGPU.device, NULL);
-  DestroyDebugUtilsMessengerEXT(&vkGPU, NULL);
-  vkDestroyInstance(vkGPU.instance, NULL);
-  glslang_finalize_process();
+  log_vkfft_timings();
+  // init_vkfft() may have failed part way, leaving later handles null.
+  if (vkGPU.device) {
+    for (size_t slot = 0; slot < kVkFFTSlots; ++slot) {
+      VkFFTSlot &s = vkSlots[slot];
+      finish_vkfft_slot(slot);
+      if (s.commandBuffer) {
+        vkFreeCommandBuffers(vkGPU.device, vkGPU.commandPool, 1,
+                             &s.commandBuffer);
+      }
+      vkDestroyFence(vkGPU.device, s.fence, NULL);
+      if (s.staging_p) {
+        vkUnmapMemory(vkGPU.device, s.stagingBufferMemory);
+      }
+      vkDestroyBuffer(vkGPU.device, s.stagingBuffer, NULL);
+      vkFreeMemory(vkGPU.device, s.stagingBufferMemory, NULL);
+      vkDestroyBuffer(vkGPU.device, s.buffer, NULL);
+      vkFreeMemory(vkGPU.device, s.bufferMemory, NULL);
+      vkDestroyBuffer(vkGPU.device, s.rawBuffer, NULL);
+      vkFreeMemory(vkGPU.device, s.rawBufferMemory, NULL);
+      vkDestroyBuffer(vkGPU.device, s.dbBuffer, NULL);
+      vkFreeMemory(vkGPU.device, s.dbBufferMemory, NULL);
+      deleteVkFFT(&s.app);
+      s = {};
+    }
+    if (vkQueryPool) {
+      vkDestroyQueryPool(vkGPU.device, vkQueryPool, NULL);
+      vkQueryPool = VK_NULL_HANDLE;
+    }
+    // descriptor sets are freed with their pool.
+    vkDestroyPipeline(vkGPU.device, windowPipeline, NULL);
+    vkDestroyPipeline(vkGPU.device, powerDbPipeline, NULL);
+    vkDestroyDescriptorPool(vkGPU.device, shaderPool, NULL);
+    vkDestroyPipelineLayout(vkGPU.device, shaderLayout, NULL);
+    vkDestroyDescriptorSetLayout(vkGPU.device, shaderSetLayout, NULL);
+    vkDestroyBuffer(vkGPU.device, windowBuffer, NULL);
+    vkFreeMemory(vkGPU.device, windowBufferMemory, NULL);
+    vkDestroyFence(vkGPU.device, vkGPU.fence, NULL);
+    vkDestroyCommandPool(vkGPU.device, vkGPU.commandPool, NULL);
+    vkDestroyDevice(vkGPU.device, NULL);
+  }
+  windowPipeline = powerDbPipeline = VK_NULL_HANDLE;
+  shaderPool = VK_NULL_HANDLE;
+  shaderLayout = VK_NULL_HANDLE;
+  shaderSetLayout = VK_NULL_HANDLE;
+  windowBuffer = VK_NULL_HANDLE;
+  windowBufferMemory = VK_NULL_HANDLE;
+  if (vkGPU.instance) {
+    DestroyDebugUtilsMessengerEXT(&vkGPU, NULL);
+    vkDestroyInstance(vkGPU.instance, NULL);
+  }
+  if (vkCompilerInitialized) {
+    glslang_finalize_process();
+    vkCompilerInitialized = false;
+  }
+  vkAppString.clear();
+  vkGPU = {};
+}
+
+// Transform frames of in_frame_size bytes from in_p, each giving
+// out_frame_size bytes at out_p, in batches through the slot ring.
+void run_vkfft_batches(const char *in_p, size_t in_frame_size, char *out_p,
+                       size_t out_frame_size, size_t frames) {
+  size_t slot = 0;
+  for (size_t k = 0; k < frames; k += vkConfiguration.numberBatches) {
+    VkFFTSlot &s = vkSlots[slot];
+    VkFFTResult resFFT = finish_vkfft_slot(slot);
+    if (resFFT != VKFFT_SUCCESS) {
+      std::cerr << "vkFFT batch failed: " << resFFT << std::endl;
+    }
+    // a short final batch transforms stale data after it, which is ignored.
+    const size_t batch_frames =
+        std::min(size_t(vkConfiguration.numberBatches), frames - k);
+    s.out_p = out_p + k * out_frame_size;
+    s.out_size = batch_frames * out_frame_size;
+    memcpy(s.staging_p, in_p + k * in_frame_size,
+           batch_frames * in_frame_size);
+    resFFT = submit_vkfft_slot(s);
+    if (resFFT != VKFFT_SUCCESS) {
+      std::cerr << "vkFFT submit failed: " << resFFT << std::endl;
+    }
+    slot = (slot + 1) % kVkFFTSlots;
+  }
+  for (size_t i = 0; i < kVkFFTSlots; ++i) {
+    VkFFTResult resFFT = finish_vkfft_slot((slot + i) % kVkFFTSlots);
+    if (resFFT != VKFFT_SUCCESS) {
+      std::cerr << "vkFFT batch failed: " << resFFT << std::endl;
+    }
+  }
 }
 
 void vkfft_specgram_offload(arma::cx_fmat &Pw_in, arma::cx_fmat &Pw) {
-  size_t row_size = Pw_in.n_rows * sample_size;
-
-  // TODO: offload windowing.
-  for (arma::uword k = 0; k < Pw_in.n_cols;
-       k += vkConfiguration.numberBatches) {
-    size_t offset = k * row_size;
-    // TODO: retain overlap buffer from previous spectrum() call.
-    uint64_t buffer_size = std::min(vkConfiguration.bufferSize[0],
-                                    (uint64_t)((Pw_in.n_cols - k) * row_size));
-    _transferDataFromCPU(((char *)Pw_in.memptr()) + offset, buffer_size);
-    performVulkanFFT(&vkGPU, &vkApp, &vkLaunchParams, -1, 1);
-    _transferDataToCPU(((char *)Pw.memptr()) + offset, buffer_size);
+  const size_t row_size = Pw_in.n_rows * sample_size;
+  run_vkfft_batches((const char *)Pw_in.memptr(), row_size,
+                    (char *)Pw.memptr(), row_size, Pw_in.n_cols);
+}
+
+void vkfft_set_power_db(bool power_db, const arma::fvec &window,
+                        size_t raw_samp_size, float window_sum,
+                        bool fftshift) {
+  if (!power_db) {
+    raw_samp_size = 0;
+    fftshift = false;
+  }
+  if (power_db == vkPowerDb && raw_samp_size == vkRawSampSize &&
+      window_sum == vkWindowSum && fftshift == vkFFTShift) {
+    return;
+  }
+  vkPowerDb = power_db;
+  vkRawSampSize = raw_samp_size;
+  vkWindowSum = window_sum;
+  vkFFTShift = fftshift;
+  if (power_db) {
+    float *window_p;
+    if (vkMapMemory(vkGPU.device, windowBufferMemory, 0,
+                    window.n_elem * sizeof(float), 0,
+                    (void **)&window_p) != VK_SUCCESS) {
+      throw std::runtime_error("cannot map vkFFT window");
+    }
+    memcpy(window_p, window.memptr(), window.n_elem * sizeof(float));
+    vkUnmapMemory(vkGPU.device, windowBufferMemory);
   }
+  // no batches are in flight between offloads.
+  for (size_t slot = 0; slot < kVkFFTSlots; ++slot) {
+    vkFreeCommandBuffers(vkGPU.device, vkGPU.commandPool, 1,
+                         &vkSlots[slot].commandBuffer);
+    VkFFTResult resFFT = record_vkfft_slot(slot);
+    if (resFFT != VKFFT_SUCCESS) {
+      throw std::runtime_error("cannot record vkFFT commands: " +
+                               std::to_string(resFFT));
+    }
+  }
+}
+
+void vkfft_specgram_power_db(const arma::cx_fmat &frames_in,
+                             arma::fmat &fft_points_out) {
+  const size_t nfft = vkConfiguration.size[0];
+  fft_points_out.set_size(nfft, frames_in.n_cols);
+  run_vkfft_batches((const char *)frames_in.memptr(),
+                    nfft * (vkRawSampSize ? vkRawSampSize : sample_size),
+                    (char *)fft_points_out.memptr(), nfft * sizeof(float),
+                    frames_in.n_cols);
 }
@@ -2,7 +2,19 @@
 #ifndef HAVE_VKFFT_H
 #define HAVE_VKFFT_H 1
 void free_vkfft();
-int64_t init_vkfft(std::size_t batches, std::size_t nfft,
-                   std::size_t sample_id);
+// If cache_dir is set, compiled kernels are loaded from (or saved to) it.
+int64_t init_vkfft(std::size_t batches, std::size_t nfft, std::size_t sample_id,
+                   const std::string &cache_dir);
+// Logs and resets the per batch upload, FFT, download and host wait times.
+void log_vkfft_timings();
 void vkfft_specgram_offload(arma::cx_fmat &Pw_in, arma::cx_fmat &Pw);
+// With power_db, vkfft_specgram_power_db() windows frames and converts the
+// FFT to dB (as power_db()) on the GPU. Frames are raw samples of
+// raw_samp_size bytes (sc16 or fc32), or if 0, already windowed complex
+// float. Without power_db, vkfft_specgram_offload() returns complex bins.
+void vkfft_set_power_db(bool power_db, const arma::fvec &window,
+                        size_t raw_samp_size, float window_sum, bool fftshift);
+// Transform each column (frame) of frames_in to a column of dB points.
+void vkfft_specgram_power_db(const arma::cx_fmat &frames_in,
+                             arma::fmat &fft_points_out);
 #endif
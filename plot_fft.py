@@ -4,9 +4,96 @@ import numpy as np
 import matplotlib
 import matplotlib.pyplot as plt
 import argparse
+import concurrent.futures
+import json
+import math
+import os
+import struct
 
 IMSHOW_INTERPOLATION = "bilinear"
 MPL_BACKEND = "cairo"
+FFT_HEADER_MAGIC = b"UHDSRFFT"
+
+
+POINT_BYTES = {"float32": 4, "float16": 2, "uint8": 1}
+
+
+def read_zst_index(filename):
+    """Return the index of a seekable .zst file, or None if it has none."""
+    try:
+        with open(filename + ".idx") as f:
+            return json.load(f)
+    except FileNotFoundError:
+        return None
+
+
+def read_zst_range(filename, index, begin, end):
+    """Decompress the frames of a seekable .zst file holding bytes begin to
+    end (uncompressed), in parallel. Return the bytes, and the offset of the
+    first."""
+    import zstandard
+
+    # [offset, compressed offset, size, compressed size] of each frame.
+    frames = [f for f in index["frames"] if f[0] < end and f[0] + f[2] > begin]
+    if not frames:
+        return b"", begin
+    compressed = []
+    with open(filename, "rb") as f:
+        for frame in frames:
+            f.seek(frame[1])
+            compressed.append(f.read(frame[3]))
+
+    def decompress(frame):
+        return zstandard.ZstdDecompressor().decompress(frame)
+
+    with concurrent.futures.ThreadPoolExecutor() as pool:
+        return b"".join(pool.map(decompress, compressed)), frames[0][0]
+
+
+def read_file(filename):
+    """Return a file's contents, decompressing .zst files."""
+    with open(filename, "rb") as f:
+        if not filename.endswith(".zst"):
+            return f.read()
+        import zstandard
+
+        reader = zstandard.ZstdDecompressor().stream_reader(
+            f, read_across_frames=True
+        )
+        return reader.read()
+
+
+def read_fft_header(data):
+    """Return the file header (empty if none), and the offset of the points."""
+    if not data.startswith(FFT_HEADER_MAGIC):
+        return {}, 0
+    offset = len(FFT_HEADER_MAGIC)
+    (header_len,) = struct.unpack_from("<I", data, offset)
+    offset += 4
+    header = json.loads(data[offset : offset + header_len])
+    return header, offset + header_len
+
+
+def decode_fft_points(data, header):
+    """Return FFT points in dB, from data encoded as described by header."""
+    encoding = header.get("encoding", "float32")
+    data = data[: len(data) - len(data) % POINT_BYTES[encoding]]
+    if encoding == "float16":
+        points = np.frombuffer(data, dtype="<f2")
+    elif encoding == "uint8":
+        points = np.frombuffer(data, dtype=np.uint8)
+        db_min, db_max = header["db_min"], header["db_max"]
+        points = db_min + points * ((db_max - db_min) / 255)
+    else:
+        points = np.frombuffer(data, dtype="<f4")
+    return points.astype(np.float32)
+
+
+def read_fft_points(filename):
+    """Return FFT points in dB, and the file header (empty if none)."""
+    data = read_file(filename)
+    header, offset = read_fft_header(data)
+    return decode_fft_points(data[offset:], header), header
 
 
 def main():
@@ -48,18 +135,96 @@ def main():
         default=8,
         help="Height of the output PNG in inches, default is 8",
     )
+    parser.add_argument(
+        "--fftshift",
+        action="store_true",
+        help="FFT points were recorded with --fftshift (DC already centered)",
+    )
+    parser.add_argument(
+        "--start",
+        type=float,
+        default=0,
+        help="Plot from this many seconds into the file, default is 0",
+    )
+    parser.add_argument(
+        "--duration",
+        type=float,
+        default=0,
+        help="Plot this many seconds (0 for the rest of the file), default is 0",
+    )
     args = parser.parse_args()
 
+    def row_bytes(header):
+        bins = header.get("bins", header.get("nfft", args.nfft))
+        return bins * POINT_BYTES[header.get("encoding", "float32")]
+
+    def frame_seconds(header):
+        nfft = header.get("nfft", args.nfft)
+        frame_samples = nfft - header.get("nfft_overlap", 0)
+        return frame_samples / header.get("rate", args.sample_rate)
+
+    def avg_frames(header):
+        if header.get("fft_avg", "none") == "none":
+            return 1
+        return header["fft_avg_frames"]
+
+    # Of each nfft_ds slots of slot_frames frames, only the first is kept,
+    # and each row averages avg_frames kept frames.
+    def row_at(header, seconds):
+        """Return the first row starting at or after seconds."""
+        slot_frames = header.get("slot_frames", 1)
+        period = slot_frames * header.get("nfft_ds", 1)
+        frame = math.ceil(seconds / frame_seconds(header))
+        kept = frame // period * slot_frames + min(frame % period, slot_frames)
+        return math.ceil(kept / avg_frames(header))
+
+    def row_time(header, row):
+        """Return the time of the first frame of row."""
+        slot_frames = header.get("slot_frames", 1)
+        kept = row * avg_frames(header)
+        frame = kept // slot_frames * slot_frames * header.get("nfft_ds", 1)
+        return (frame + kept % slot_frames) * frame_seconds(header)
+
     matplotlib.use(MPL_BACKEND)
-    i = np.fromfile(args.filename, dtype=np.float32)
-    sample_count = i.shape[0]
-    i = np.roll(i.reshape(-1, args.nfft).swapaxes(0, 1), int(args.nfft / 2), 0)
+    index = None
+    if args.filename.endswith(".zst") and (args.start or args.duration):
+        index = read_zst_index(args.filename)
+    if index:
+        # seekable: only decompress the frames holding the rows plotted.
+        data, _ = read_zst_range(args.filename, index, 0, 1)
+        header, offset = read_fft_header(data)
+        first_row = row_at(header, args.start)
+        begin = offset + first_row * row_bytes(header)
+        end = index["frames"][-1][0] + index["frames"][-1][2]
+        if args.duration:
+            rows = row_at(header, args.start + args.duration) - first_row
+            end = min(end, begin + rows * row_bytes(header))
+        data, data_begin = read_zst_range(args.filename, index, begin, end)
+        i = decode_fft_points(data[begin - data_begin : end - data_begin], header)
+    else:
+        i, header = read_fft_points(args.filename)
+    nfft = header.get("nfft", args.nfft)
+    bins = header.get("bins", nfft)
+    fftshift = header.get("fftshift", args.fftshift)
+    sample_rate = header.get("rate", args.sample_rate)
+    i = i[: i.shape[0] - i.shape[0] % bins].reshape(-1, bins)
+    if not index:
+        first_row = row_at(header, args.start)
+        rows = i.shape[0]
+        if args.duration:
+            rows = row_at(header, args.start + args.duration) - first_row
+        i = i[first_row : first_row + rows]
+    start = row_time(header, first_row)
+    i = i.swapaxes(0, 1)
+    if not fftshift:
+        i = np.roll(i, int(bins / 2), 0)
     fc = args.center_freq / 1e6
-    fo = args.sample_rate / 1e6 / 2
-    extent = (0, sample_count / args.sample_rate, fc - fo, fc + fo)
-    
-    png_file = f"{args.filename}_{int(args.center_freq)}_{int(args.sample_rate)}.png"
-    
+    fo = sample_rate / 1e6 / 2
+    end_time = row_time(header, first_row + i.shape[1])
+    extent = (start, end_time, fc - fo, fc + fo)
+
+    png_file = f"{args.filename}_{int(args.center_freq)}_{int(sample_rate)}.png"
+
     fig = plt.figure()
     fig.set_size_inches(args.width, args.height)
     axes = fig.add_subplot(111)